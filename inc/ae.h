@@ -17,10 +17,14 @@
 
 #define AE_NOMORE       -1
 
+/* Event loop flags */
+#define AE_FLAG_EDGE    1   /* edge-triggered notification */
+
 /* Macros */
 #define AE_NOTUSED(V)   ((void)V)
 
 struct ae_event_loop;
+struct ae_api;
 
 /* Type and data structures */
 typedef void ae_file_proc(struct ae_event_loop *el, int fd, 
@@ -30,13 +34,26 @@ typedef int ae_time_proc(struct ae_event_loop *el, long long id,
 typedef void ae_event_finalizer_proc(struct ae_event_loop *el,
         void *client_data);
 typedef void ae_before_sleep_proc(struct ae_event_loop *el);
+typedef int ae_spin_proc(struct ae_event_loop *el, int spinning);
+typedef void ae_slow_proc(struct ae_event_loop *el, int fd, void *proc,
+        const char *symbol, long long us);
+/* Completion of an I/O operation submitted with ae_io_*(), 'res' is the
+   result of the syscall or -errno. 'fd' is -1 when the operation was
+   cancelled by ae_io_cancel(), then only what it holds is released: the
+   fd accepted or the buffer sent. */
+typedef void ae_io_proc(struct ae_event_loop *el, int fd, 
+        void *client_data, int res, char *buf);
 
 /* File event structure */
 typedef struct ae_file_event {
     int mask; /* one of AE_(READABLE|WRITABLE) */
     ae_file_proc    *r_file_proc;
     ae_file_proc    *w_file_proc;
+    const char      *r_name;    /* handler names, for the slow reports */
+    const char      *w_name;
     void *client_data;
+    int ready;   /* readiness cached in edge-triggered mode */
+    int pending; /* whether the fd is queued in el->pending */
 } ae_file_event;
 
 /* Time event structure */
@@ -46,6 +63,7 @@ typedef struct ae_time_event {
     long when_ms;   /* milliseconds */
     ae_time_proc    *time_proc;
     ae_event_finalizer_proc *finalizer_proc;
+    const char      *name;  /* the handler name, for the slow reports */
     void *client_data;
     struct ae_time_event *next;
 } ae_time_event;
@@ -56,33 +74,104 @@ typedef struct ae_fired_event {
     int mask;
 } ae_fired_event;
 
+/* Utilization of the loop in busy-polling mode */
+typedef struct ae_loop_stats {
+    unsigned long long  iterations;
+    unsigned long long  spin_polls;     /* non-blocking polls */
+    unsigned long long  spin_hits;      /* ... which found some events */
+    unsigned long long  spin_idle_us;   /* time spent in fruitless polls */
+    unsigned long long  blocks;         /* times the loop fell asleep */
+} ae_loop_stats;
+
+/* Histogram of durations, bucket i counts [2^(i-1), 2^i) microseconds */
+#define AE_HIST_BUCKETS 24
+typedef struct ae_histogram {
+    unsigned long long  count;
+    unsigned long long  sum_us;
+    unsigned long long  max_us;
+    unsigned long long  buckets[AE_HIST_BUCKETS];
+} ae_histogram;
+
+/* Instrumentation of the loop, per iteration */
+typedef struct ae_timing {
+    ae_histogram    poll;   /* time spent in the multiplexing layer */
+    ae_histogram    file;   /* time spent in file event callbacks */
+    ae_histogram    time;   /* time spent in time event callbacks */
+    long long       slow_us;
+    ae_slow_proc    *slow_proc;
+} ae_timing;
+
 /* State of an event base program */
 typedef struct ae_event_loop {
     int maxfd;
+    int flags;
     long long time_event_next_id;
     ae_file_event   events[AE_SETSIZE]; /* Registered events */
     ae_fired_event  fired[AE_SETSIZE];  /* Fired events */
+    int npending;
+    int pending[AE_SETSIZE]; /* fds still ready in edge-triggered mode */
     ae_time_event   *time_event_head;
+    struct ae_api *api; /* The multiplexing layer in use. */
     void *api_data; /* This is used for polling API specific data. */
     ae_before_sleep_proc    *before_sleep;
+    long long   busy_poll_us;   /* spin window after the last event */
+    long long   last_event_us;
+    ae_spin_proc    *spin_proc;
+    ae_loop_stats   stats;
+    ae_timing       *timing; /* NULL unless the instrumentation enabled */
 } ae_event_loop;
 
 /* Prototypes */
 ae_event_loop   *ae_create_event_loop(void);
+ae_event_loop   *ae_create_event_loop_api(const char *api);
 void ae_free_event_loop(ae_event_loop *el);
 int ae_create_file_event(ae_event_loop *el, int fd, int mask,
         ae_file_proc *proc, void *client_data);
+int ae_create_file_event_named(ae_event_loop *el, int fd, int mask,
+        ae_file_proc *proc, void *client_data, const char *name);
 void ae_delete_file_event(ae_event_loop *el, int fd, int mask);
-int ae_get_file_event(ae_event_loop *el, int fd);
+int ae_get_file_events(ae_event_loop *el, int fd);
 long long ae_create_time_event(ae_event_loop *el, long long milliseconds,
         ae_time_proc *proc, void *client_data,
         ae_event_finalizer_proc *finalizer_proc);
+long long ae_create_time_event_named(ae_event_loop *el, 
+        long long milliseconds, ae_time_proc *proc, void *client_data,
+        ae_event_finalizer_proc *finalizer_proc, const char *name);
 int ae_delete_time_event(ae_event_loop *el, long long id);
 int ae_process_events(ae_event_loop *el, int flags);
 int ae_wait(int fd, int mask, long long milliseconds);
 void ae_main(ae_event_loop *el, int *quit);
-char *ae_get_api_name(void);
+char *ae_get_api_name(ae_event_loop *el);
 void ae_set_before_sleep_proc(ae_event_loop *el, 
         ae_before_sleep_proc *before_sleep);
+int ae_set_edge_triggered(ae_event_loop *el, int on);
+void ae_set_busy_poll(ae_event_loop *el, long long usec, 
+        ae_spin_proc *spin_proc);
+void ae_get_loop_stats(ae_event_loop *el, ae_loop_stats *stats, int reset);
+int ae_enable_timing(ae_event_loop *el, long long slow_us, 
+        ae_slow_proc *slow_proc);
+void ae_disable_timing(ae_event_loop *el);
+int ae_get_timing(ae_event_loop *el, ae_timing *timing, int reset);
+long long ae_histogram_percentile(ae_histogram *h, double percentile);
+void ae_clear_ready(ae_event_loop *el, int fd, int mask);
+int ae_io_supported(ae_event_loop *el);
+int ae_io_accept(ae_event_loop *el, int fd, ae_io_proc *proc, 
+        void *client_data);
+int ae_io_recv(ae_event_loop *el, int fd, ae_io_proc *proc, 
+        void *client_data);
+int ae_io_send(ae_event_loop *el, int fd, char *buf, int len, 
+        ae_io_proc *proc, void *client_data);
+void ae_io_cancel(ae_event_loop *el, int fd);
+
+/* The handlers are registered under their names, so the slow callback
+   reports can tell them even when they are static. */
+#ifndef AE_NO_NAMES
+#define ae_create_file_event(el, fd, mask, proc, client_data) \
+    ae_create_file_event_named(el, fd, mask, proc, client_data, #proc)
+#define ae_create_time_event(el, milliseconds, proc, client_data, \
+        finalizer_proc) \
+    ae_create_time_event_named(el, milliseconds, proc, client_data, \
+        finalizer_proc, #proc)
+#endif /* AE_NO_NAMES */
 
 #endif /*__AE_H_INCLUDED__ */
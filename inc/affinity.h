@@ -0,0 +1,24 @@
+/* CPU pinning of the conn and worker processes, and NUMA placement of
+ * the queues they share. */
+#ifndef __AFFINITY_H_INCLUDED__
+#define __AFFINITY_H_INCLUDED__
+
+#include <stddef.h>
+#include "conf.h"
+
+/* Called in the master. Lays out the CPUs configured by 'conn_cpu' and
+ * 'worker_cpus', either CPU lists like "0,2-5" or "auto". Returns 0 on
+ * success, -1 on a bad configuration. */
+extern int affinity_init(conf_t *conf);
+
+/* Pin the calling process, or thread, to its CPUs. */
+extern int affinity_apply_conn(void);
+extern int affinity_apply_worker(int index);
+
+/* The NUMA node the processes are placed on, -1 if unknown. */
+extern int affinity_node(void);
+
+/* Move the memory to the node of the processes, if 'numa_bind' is on. */
+extern int affinity_bind_memory(void *addr, size_t len);
+
+#endif /* __AFFINITY_H_INCLUDED__ */
@@ -0,0 +1,23 @@
+/* CoDel, the controlled delay admission of the requests: when the time
+ * the requests wait in the queue stays above the target for an 
+ * interval, they are shed at a rate growing with the square root of 
+ * the count shed, until the delay drops below the target. */
+#ifndef __CODEL_H_INCLUDED__
+#define __CODEL_H_INCLUDED__
+
+typedef struct codel {
+    long long   target;         /* microseconds */
+    long long   interval;
+    long long   first_above;    /* when the delay may be judged standing */
+    long long   drop_next;
+    int         count;          /* shed in the current dropping state */
+    int         dropping;
+} codel_t;
+
+extern void codel_init(codel_t *c, long long target, long long interval);
+
+/* Returns 1 if the request which waited `sojourn' microseconds should 
+ * be shed, `now' is the monotonic clock in microseconds. */
+extern int codel_should_drop(codel_t *c, long long sojourn, long long now);
+
+#endif /* __CODEL_H_INCLUDED__ */
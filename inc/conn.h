@@ -7,31 +7,71 @@
 #define VERBEN_OK               0x00000000
 #define VERBEN_ERROR            0x00000001
 #define VERBEN_CONN_CLOSE       0x00000002
+#define VERBEN_PENDING          0x00000004
+#define VERBEN_DECLINED         0x00000008
 
 #define CONN_MSG_MAGIC          0x567890EF
 #define CONN_MAGIC_DEBUG        0x1234ABCD
 
+/* The types of the messages from the workers to the conn process */
+#define SHM_MSG_RESPONSE        0   /* to the request */
+#define SHM_MSG_PUSH            1   /* to the connection `conn_id' */
+#define SHM_MSG_JOIN            2   /* `conn_id' joins the group `data' */
+#define SHM_MSG_LEAVE           3
+#define SHM_MSG_GROUP           4   /* the group name, NUL, the data */
+#define SHM_MSG_BROADCAST       5   /* to all the connections */
+
+/* A response waiting for the flush phase */
+typedef struct conn_out {
+    struct shm_msg  *msg;
+    int             len;    /* length of the response data */
+    int             *refs;  /* the recipients of a shared push, or NULL */
+} conn_out;
+
 typedef struct client_conn {
 #ifdef DEBUG
     int     magic;
 #endif /* DEBUG */
     int     fd;
+    unsigned long long id;  /* the slot and its generation */
     int     close_conn; /* whether close connection after send response */
     char    *remote_ip;
     int     remote_port;
+    void    *ctx;       /* attached by handle_open_v2 */
+    int     scanned;    /* bytes of `recvbuf' scanned by handle_input_v2 */
     int     recv_prot_len;
     char    *sendbuf;
+    char    *sending;   /* sent by the io_uring completion layer */
     char    *recvbuf;
     time_t  access_time;
+    int     inflight;   /* requests not answered yet by the workers */
+    int     paused;     /* not read at the in-flight limit */
+    int     flush_idx;  /* position in the flush list, -1 if not in it */
+    int     nout;
+    int     out_size;
+    conn_out *out;      /* responses collected in this loop iteration */
+    unsigned int next_seq;  /* stamped on the next request */
+    unsigned int send_seq;  /* of the response to be sent next */
+    int     nheld;
+    int     held_size;
+    conn_out *held;     /* responses arrived ahead of their turn */
+    int     ngroups;
+    int     groups_size;
+    struct group_ref *groups;   /* joined with verben_group_join */
+    struct fair_flow *flow;     /* the requests waiting for their turn */
 } client_conn;
 
 typedef struct shm_msg {
-    client_conn     *cli;
-    int             fd;
+    unsigned long long conn_id; /* the slot and the generation, see
+                                   verben_conn_id() */
+    unsigned int    seq; /* the order of the request in the connection */
+    void            *ctx; /* of the connection, see handle_open_v2 */
+    int             type; /* SHM_MSG_* */
+    long long       enqueue_us; /* the monotonic clock when queued */
 #ifdef DEBUG
     unsigned int    identi;
-    unsigned int    magic; /* the field just to protect `cli`'s usage to
-                              avoid core dump upon some error. */
+    unsigned int    magic; /* the field just to detect a corrupted 
+                              message upon some error. */
 #endif /* DEBUG */
     pid_t           pid; /* the field used to check whethe the receiving 
                         * conn process is a new conn process. */
@@ -0,0 +1,50 @@
+/* Stackful coroutines on ucontext, scheduled by an ae event loop. The
+ * I/O helpers suspend the running coroutine until the event loop sees
+ * the fd ready, so the code calling them reads sequentially. */
+#ifndef __CORO_H_INCLUDED__
+#define __CORO_H_INCLUDED__
+
+#include <stddef.h>
+#include "ae.h"
+#include "upstream.h"
+
+#define CORO_STACK_SIZE     (64 * 1024)
+
+typedef struct coro coro_t;
+typedef void coro_proc(void *arg);
+
+/* Stacks of finished coroutines are kept for reuse, up to `max_pool'. */
+int coro_init(ae_event_loop *el, size_t stack_size, int max_pool);
+coro_t *coro_create(coro_proc *proc, void *arg);
+
+/* Run `co' until it yields or finishes. A finished coroutine is
+ * recycled, the return value is 1 then, otherwise 0. */
+int coro_resume(coro_t *co);
+void coro_yield(void);
+
+/* NULL when not running in a coroutine. */
+coro_t *coro_current(void);
+void *coro_arg(coro_t *co);
+int coro_active(void);
+
+/* The helpers below yield to the event loop in a coroutine, and block
+ * the caller otherwise. `timeout' is in milliseconds, -1 for none. */
+
+/* Returns the mask ready, 0 on timeout, -1 on error. */
+int coro_wait_fd(int fd, int mask, long long timeout);
+void coro_sleep(long long ms);
+
+/* Like read(2)/write(2) on a nonblocking fd. coro_write() writes all
+ * the bytes unless an error occurs. On timeout, -1 is returned with
+ * errno ETIMEDOUT. */
+int coro_read(int fd, char *buf, int len, long long timeout);
+int coro_write(int fd, const char *buf, int len, long long timeout);
+int coro_connect(char *host, int port, long long timeout);
+
+/* Issue an upstream request and wait for it. Returns the UPSTREAM_*
+ * status, on UPSTREAM_OK the response is returned in `resp' and
+ * `resp_len', it should be freed by the caller. Only in a coroutine. */
+int coro_upstream_request(upstream_t *up, const char *buf, int len,
+        char **resp, int *resp_len);
+
+#endif /* __CORO_H_INCLUDED__ */
@@ -0,0 +1,32 @@
+/* Fair queueing of the requests in the conn process. The requests wait
+ * in a queue per connection, or per client IP, and are passed on to the
+ * workers by deficit round-robin while fewer than 'fair_backlog' are 
+ * queued to them, so a client pipelining heavily doesn't delay the 
+ * others. */
+#ifndef __FAIR_H_INCLUDED__
+#define __FAIR_H_INCLUDED__
+
+#include "conf.h"
+#include "conn.h"
+
+#define FAIR_NONE       0   /* the requests go to the workers at once */
+#define FAIR_CONN       1   /* a queue per connection */
+#define FAIR_IP         2   /* a queue per client IP */
+
+/* Parses 'fair_queue' and 'fair_quantum'. Returns 0 on success, -1 on a
+ * bad configuration. */
+extern int fair_init(conf_t *conf);
+extern int fair_policy(void);
+
+/* Queue the request of the connection. Returns 0 on success, -1 if out
+ * of memory, `msg' isn't freed then. */
+extern int fair_enqueue(client_conn *cli, shm_msg *msg, int len);
+
+/* Take the request whose turn it is. Returns 0 on success, -1 if none
+ * is queued. */
+extern int fair_dequeue(client_conn **cli, shm_msg **msg, int *len);
+
+/* Called when the connection is closed, its requests are dropped. */
+extern void fair_detach(client_conn *cli);
+
+#endif /* __FAIR_H_INCLUDED__ */
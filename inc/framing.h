@@ -0,0 +1,23 @@
+/* Native framing of the protocol messages in the conn process, for the
+ * protocols a plugin would otherwise cut with handle_input. */
+#ifndef __FRAMING_H_INCLUDED__
+#define __FRAMING_H_INCLUDED__
+
+#include "conf.h"
+
+#define FRAMING_NONE        0   /* handle_input cuts the messages */
+#define FRAMING_LENGTH      1   /* a fixed header with a length field */
+#define FRAMING_DELIMITER   2   /* terminated by a byte sequence */
+
+/* Called in the master, parses 'framing'. Returns 0 on success, -1 on a
+ * bad configuration. */
+extern int framing_init(conf_t *conf);
+extern int framing_type(void);
+
+/* Same as handle_input_v2: returns the length of the message at the
+ * head of `buf', 0 if it's incomplete, or -1 if it's invalid or no
+ * delimiter is found in `max' bytes. `*scanned' bytes were searched by
+ * the previous calls for the message. */
+extern int framing_input(const char *buf, int len, int *scanned, int max);
+
+#endif /* __FRAMING_H_INCLUDED__ */
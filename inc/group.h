@@ -0,0 +1,23 @@
+/* Named groups of connections in the conn process, the targets of the
+ * pushes of verben_group_push(). */
+#ifndef __GROUP_H_INCLUDED__
+#define __GROUP_H_INCLUDED__
+
+#include "conn.h"
+
+#define GROUP_NAME_MAX      64
+
+extern int group_init(void);
+
+/* Returns 0 on success, -1 on error. Joining a group twice is a no-op. */
+extern int group_join(client_conn *cli, const char *name);
+extern int group_leave(client_conn *cli, const char *name);
+
+/* Called when the connection is closed. */
+extern void group_leave_all(client_conn *cli);
+
+/* The members of the group, NULL if it has none. The array is valid
+ * until a connection joins or leaves the group. */
+extern client_conn **group_members(const char *name, int *n);
+
+#endif /* __GROUP_H_INCLUDED__ */
@@ -0,0 +1,22 @@
+/* The connections open in the conn process, shared with the workers, so
+ * the requests of the closed ones aren't processed. */
+#ifndef __LIVENESS_H_INCLUDED__
+#define __LIVENESS_H_INCLUDED__
+
+#include "conf.h"
+
+/* Called in the master before spawning the processes, a slot is kept for
+ * each of 'client_limit' connections. Returns 0 on success, -1 on 
+ * error. */
+extern int liveness_init(conf_t *conf);
+
+/* In the conn process, when the connection of the id is opened or 
+ * closed. */
+extern void liveness_set(unsigned long long id);
+extern void liveness_clear(unsigned long long id);
+
+/* Returns 0 if the connection of the id has been closed. The ids of the
+ * slots past the table are taken as open. */
+extern int liveness_check(unsigned long long id);
+
+#endif /* __LIVENESS_H_INCLUDED__ */
@@ -0,0 +1,18 @@
+/* Bounded lock-free multi-producer multi-consumer queue of pointers,
+ * for passing messages between the threads of a process. */
+#ifndef __MPMC_H_INCLUDED__
+#define __MPMC_H_INCLUDED__
+
+typedef struct mpmc mpmc_t;
+
+/* The size is rounded up to a power of 2. */
+extern mpmc_t *mpmc_create(unsigned int size);
+extern void mpmc_free(mpmc_t *q);
+
+/* Returns 0 on success, -1 when the queue is full. */
+extern int mpmc_push(mpmc_t *q, void *data, int len);
+
+/* Returns 0 on success, -1 when the queue is empty. */
+extern int mpmc_pop(mpmc_t *q, void **data, int *len);
+
+#endif /* __MPMC_H_INCLUDED__ */
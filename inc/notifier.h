@@ -7,5 +7,6 @@ void notifier_close_rd();
 int notifier_read_fd();
 int notifier_read();
 int notifier_write();
+void notifier_set_spinning(int on);
 
 #endif /* __NOTIFIER_H_INCLUDED__ */
@@ -3,6 +3,7 @@
 
 #include <sys/cdefs.h>
 #include "conn.h"
+#include "worker.h"
 
 __BEGIN_DECLS
 
@@ -11,9 +12,24 @@ __BEGIN_DECLS
  * the process at beginning phase. You should do some 
  * initializetion work in it. When success, please ruturn
  * 0, otherwise -1 should be returned. Upon failure, the
- * verben daemon will exit immediately. */
+ * verben daemon will exit immediately. The `cycle' is a
+ * vb_cycle_t, in conn and worker processes the timers and
+ * file events of the plugin can be registered on its event
+ * loop `el' with ae_create_time_event/ae_create_file_event,
+ * the callbacks run between the requests. */
 int handle_init(void *cycle, int proc_type);
 
+/* It's optional. With 'worker_mode thread', the workers are
+ * threads of the conn process, and handle_init is not invoked
+ * for them. This one is invoked in each worker thread instead
+ * to set up the per-thread state, `index' is the number of the
+ * thread. The `cycle' has no event loop. Return 0 on success,
+ * otherwise the daemon will exit. */
+int handle_thread_init(void *cycle, int index);
+
+/* It's optional. Invoked when a worker thread exits. */
+void handle_thread_fini(void *cycle, int index);
+
 /* It's optional. If implemented, it would be invoked when
  * the process would exit. You should do some destructation
  * work in it. */
@@ -34,15 +50,94 @@ void handle_close(const char *remote_ip, int port);
 /* This function is mandatory. Your plugin MUST implemente this 
  * function. This function should return the length of a protocal
  * message. When it's unknown, return 0. You also can return -1
- * to close this connection. */
+ * to close this connection. It's optional when 'framing' is set in
+ * the conf file, the conn process cuts the messages itself. */
 int handle_input(char*recvbuf, int recvlen, 
         const char *remote_ip, int port);
 
 /* This function is mandatory. Your plugin MUST implement it. 
- * The protocol message mainly was processed in it. */
+ * The protocol message mainly was processed in it. To answer it later
+ * without blocking the worker, keep the token got from verben_current()
+ * and return VERBEN_PENDING, then send the response with verben_reply().
+ * With 'worker_mode coroutine', it runs on a coroutine, the helpers of
+ * coro.h wait for I/O without blocking the other requests. */
 int handle_process(char *recvbuf, int recvlen, 
         char **sendbuf, int *sendlen, const char *remote_ip, int port);
 
+/* It's optional. It would be invoked after the response of
+ * handle_process has been sent, to free the `sendbuf'. */
+void handle_process_post(char *sendbuf, int sendlen);
+
+/* The version 2 of the API. When a hook below is implemented, it's 
+ * invoked instead of its version 1 above, either version of 
+ * handle_input (unless 'framing' is set) and handle_process is 
+ * mandatory. */
+
+/* Like handle_open, `ctx' can be set to the state of the connection. 
+ * It's passed to the other hooks of the connection. */
+int handle_open_v2(void **ctx, char **sendbuf, int *len, 
+        const char *remote_ip, int port);
+
+/* Like handle_close, the `ctx' should be freed here. It's NULL if the
+ * connection is closed before handle_open_v2 is invoked. */
+void handle_close_v2(void *ctx, const char *remote_ip, int port);
+
+/* Like handle_input, but `*scanned' bytes of `recvbuf' have been seen
+ * by the previous calls for the same message, set it to the bytes 
+ * scanned in this call, so the framing costs O(n) in total. It starts
+ * from 0 for each message. The parse state can be kept in `ctx'. */
+int handle_input_v2(void *ctx, const char *recvbuf, int recvlen, 
+        int *scanned, const char *remote_ip, int port);
+
+/* Like handle_process, with the `ctx' of the connection. It's the 
+ * value set in the conn process, so it can be dereferenced with 
+ * 'worker_mode thread' only, the worker processes can use it as an
+ * identifier of the connection. */
+int handle_process_v2(void *ctx, char *recvbuf, int recvlen, 
+        char **sendbuf, int *sendlen, const char *remote_ip, int port);
+
+/* It's optional. With 'codel_target', the requests which waited in the
+ * queue too long under overload are shed, this one is invoked instead
+ * of handle_process to answer them cheaply, like a "server busy" 
+ * message. The arguments and the value returned are those of 
+ * handle_process, VERBEN_PENDING isn't supported. If it's not 
+ * implemented, the connections of the shed requests are closed. */
+int handle_reject(char *recvbuf, int recvlen, 
+        char **sendbuf, int *sendlen, const char *remote_ip, int port);
+
+/* It's optional. If implemented, the workers pop up to 'batch_size'
+ * queued requests and pass them at once instead of calling 
+ * handle_process on each, so they can be processed in groups. Fill 
+ * in `resps[i]' for `msgs[i]', VERBEN_PENDING isn't supported here.
+ * Return VERBEN_OK, or VERBEN_ERROR to fail the whole batch. With 
+ * 'worker_mode coroutine', handle_process is used. */
+int handle_process_batch(verben_msg_t *msgs, int n, verben_resp_t *resps);
+
+/* It's optional. Invoked in the conn process with each complete 
+ * protocol message before it's queued to the workers, to answer the 
+ * cheap ones, like health checks or cache hits, without the round trip.
+ * Point `sendbuf' to the response and return VERBEN_OK, or 
+ * VERBEN_CONN_CLOSE to close the connection after it's sent. The
+ * response is copied, the buffer is the plugin's and can be reused by
+ * the next call. Return VERBEN_DECLINED to pass the message on to the
+ * workers, or VERBEN_ERROR to close the connection.
+ * It runs on the event loop of all the connections: it MUST NOT block, 
+ * do I/O or take locks, and should return within microseconds. Once 
+ * the calls in a loop iteration take 'fast_budget' microseconds, the
+ * rest of the messages go to the workers until the next iteration. With
+ * 'ordered_responses', a connection waiting for the workers isn't 
+ * answered here. */
+int handle_fast(const char *recvbuf, int recvlen, char **sendbuf, 
+        int *sendlen, const char *remote_ip, int port);
+
+/* It's mandatory with 'route key'. Invoked in the conn process with a
+ * complete protocol message, it returns a non-negative hash of the key
+ * of the message. Messages with the same key go to the same worker
+ * while the pool is unchanged. Return -1 to route the message by its
+ * connection. */
+int handle_route(const char *recvbuf, int recvlen,
+        const char *remote_ip, int port);
+
 /* Add interp section just for geek.
  * This partion of code can be remove to Makefile 
  * to determine RTLD(runtime loader). */
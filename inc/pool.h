@@ -0,0 +1,24 @@
+/* Bump allocator, the memory is released all at once by resetting the
+ * pool. */
+#ifndef __POOL_H_INCLUDED__
+#define __POOL_H_INCLUDED__
+
+#include <stddef.h>
+
+#define POOL_BLOCK_SIZE     4096
+
+typedef struct pool pool_t;
+
+/* The pool allocates blocks of `block_size' bytes, larger chunks are
+ * allocated on their own. */
+extern pool_t *pool_create(size_t block_size);
+extern void pool_free(pool_t *p);
+
+/* Returns memory aligned for any type, NULL if out of memory. */
+extern void *pool_alloc(pool_t *p, size_t size);
+extern char *pool_strndup(pool_t *p, const char *s, size_t n);
+
+/* Release all the memory allocated, only the first block is kept. */
+extern void pool_reset(pool_t *p);
+
+#endif /* __POOL_H_INCLUDED__ */
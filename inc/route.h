@@ -0,0 +1,46 @@
+/* Routing of the requests from the conn process to the workers. */
+#ifndef __ROUTE_H_INCLUDED__
+#define __ROUTE_H_INCLUDED__
+
+#include "conf.h"
+#include "conn.h"
+
+#define ROUTE_SHARED        0   /* one queue shared by all the workers */
+#define ROUTE_CONN          1   /* a connection sticks to a worker */
+#define ROUTE_KEY           2   /* by the key hash of handle_route */
+#define ROUTE_LEAST_LOADED  3   /* to the worker with the least requests */
+
+/* Called in the master before spawning the processes. Every worker has
+ * a wakeup pipe of its own and, except for the shared policy, a queue of
+ * its own, 'max_workers' of them are created. Returns 0 on success, -1 
+ * on error. */
+extern int route_init(conf_t *conf, int nworkers, int max_workers);
+extern void route_free(void);
+extern int route_policy(void);
+
+/* The master tells the conn process how many workers take requests, the
+ * workers below 'n' do. */
+extern void route_set_workers(int n);
+
+/* Requests queued to the workers. */
+extern int route_queued(void);
+
+/* In the conn process, queue a request and wake up the workers it was
+ * queued to. */
+extern int route_push(client_conn *cli, shm_msg *msg, int len);
+extern int route_wake(void);
+
+/* In the worker process with index 'index'. */
+extern void route_attach(int index);
+extern void route_detach(void);
+extern int route_read_fd(void);
+extern int route_read(void);
+extern int route_wake_self(void);
+extern int route_pop(shm_msg **msg, int *len);
+extern int route_pop_batch(shm_msg **msgs, int *lens, int max);
+extern int route_queued_self(void);
+extern int route_sleep(void);
+extern void route_done(void);
+extern int route_retired(void);
+
+#endif /* __ROUTE_H_INCLUDED__ */
@@ -14,5 +14,9 @@ extern void shmq_destroy(shmq_t *q);
 extern void shmq_free(shmq_t *q);
 extern int shmq_push(shmq_t *q, void *data, size_t len, int flags);
 extern int shmq_pop(shmq_t *q, void **retdata, int *len, int flags);
+extern int shmq_pop_batch(shmq_t *q, void **retdata, int *len, int max,
+        int flags);
+extern int shmq_count(shmq_t *q);
+extern void *shmq_memory(shmq_t *q, size_t *len);
 
 #endif /* __SHMQ_H_INCLUDED__ */
@@ -0,0 +1,57 @@
+/* Non-blocking connection pool to a backend TCP service, driven by an
+ * ae event loop. The requests are pipelined over a limited number of
+ * keepalive connections, the responses are matched in FIFO order. */
+#ifndef __UPSTREAM_H_INCLUDED__
+#define __UPSTREAM_H_INCLUDED__
+
+#include "ae.h"
+
+#define UPSTREAM_OK         0
+#define UPSTREAM_ERROR      1   /* connect, I/O or protocol error */
+#define UPSTREAM_TIMEOUT    2
+
+typedef struct upstream upstream_t;
+
+/* Returns the length of the response at the beginning of `buf', 0 when
+ * it's incomplete, -1 on a protocol error. Like handle_input. */
+typedef int upstream_input_proc(const char *buf, int len);
+
+/* Invoked once per request. On UPSTREAM_OK, `buf' holds the response of
+ * `len' bytes, it's only valid in the callback. Otherwise `buf' is NULL.
+ * A new request may be issued in the callback, but the upstream MUST
+ * NOT be freed. */
+typedef void upstream_callback(int status, const char *buf, int len,
+        void *privdata);
+
+typedef struct upstream_stats {
+    long long   requests;
+    long long   errors;
+    long long   timeouts;
+    long long   connects;   /* connections created */
+    int         conns;      /* connections alive */
+    int         inflight;   /* requests written or being written */
+    int         waiting;    /* requests waiting for a connection */
+} upstream_stats_t;
+
+/* Prototypes */
+upstream_t *upstream_create(ae_event_loop *el, char *host, int port,
+        upstream_input_proc *input);
+void upstream_free(upstream_t *up);
+
+/* `max_conns' connections at most, each carrying up to `pipeline'
+ * requests at once, and no more than `max_inflight' requests in total.
+ * A request not answered in `timeout' milliseconds fails, 0 to wait
+ * forever. Connections idle for `idle_timeout' milliseconds are closed,
+ * 0 to keep them. */
+void upstream_set_limits(upstream_t *up, int max_conns, int pipeline,
+        int max_inflight, int timeout, int idle_timeout);
+
+/* Queue a request, the bytes are copied. Returns 0 on success, the
+ * callback is never invoked before this function returns. Returns -1
+ * when out of memory. */
+int upstream_request(upstream_t *up, const char *buf, int len,
+        upstream_callback *cb, void *privdata);
+
+void upstream_get_stats(upstream_t *up, upstream_stats_t *stats);
+
+#endif /* __UPSTREAM_H_INCLUDED__ */
@@ -11,6 +11,9 @@
 #define VB_PROCESS_WORKER   1
 #define VB_PROCESS_CONN     2
 
+struct verben_msg;
+struct verben_resp;
+
 typedef struct dll_func_struct {
     int (*handle_init)(void *, int);
     void (*handle_fini)(void *, int);
@@ -19,8 +22,27 @@ typedef struct dll_func_struct {
     int (*handle_input)(const char*, int, char *, int);
     int (*handle_process)(char *, int, char **, int *, char *, int);
     int (*handle_process_post)(char *, int);
+    int (*handle_open_v2)(void **, char **, int *, char *, int);
+    void (*handle_close_v2)(void *, char *, int);
+    int (*handle_input_v2)(void *, const char *, int, int *, char *, int);
+    int (*handle_process_v2)(void *, char *, int, char **, int *, 
+            char *, int);
+    int (*handle_thread_init)(void *, int);
+    void (*handle_thread_fini)(void *, int);
+    int (*handle_route)(const char *, int, char *, int);
+    int (*handle_fast)(const char *, int, char **, int *, char *, int);
+    int (*handle_reject)(char *, int, char **, int *, char *, int);
+    int (*handle_process_batch)(struct verben_msg *, int, 
+            struct verben_resp *);
 } dll_func_t;
 
+/* Passed to the hooks handle_init and handle_fini as `cycle'. The `conf'
+ * MUST be the first member, so the cycle can still be cast to conf_t. */
+typedef struct vb_cycle {
+    conf_t          conf;
+    ae_event_loop   *el;    /* NULL in the master process */
+} vb_cycle_t;
+
 extern int vb_process;
 extern shmq_t *recv_queue;
 extern shmq_t *send_queue;
@@ -1,6 +1,105 @@
 #ifndef __WORKER_H_INCLUDED__
 #define __WORKER_H_INCLUDED__
 
+#include "conn.h"
+#include "pool.h"
+
+/* The id of a connection, 0 is never a valid one. */
+typedef unsigned long long verben_conn_t;
+
+/* A request whose response is deferred by the plugin. It retains the 
+ * message header which routes the response back to the connection. */
+typedef struct verben_req {
+    shm_msg     *msg;
+    int         len;
+    shm_msg     *resp;  /* from verben_response_alloc() */
+    pool_t      *pool;  /* the arena of verben_palloc() */
+} verben_req_t;
+
+/* A request of a batch passed to handle_process_batch. */
+typedef struct verben_msg {
+    char        *data;
+    int         len;
+    const char  *remote_ip;
+    int         remote_port;
+    void        *ctx;   /* of the connection, see handle_open_v2 */
+} verben_msg_t;
+
+/* The response to a request of a batch. `ret' has the meaning of the
+ * value returned by handle_process, `data' is freed by the hook
+ * handle_process_post. */
+typedef struct verben_resp {
+    int         ret;
+    char        *data;
+    int         len;
+} verben_resp_t;
+
 void worker_process_cycle(void *data);
 
+/* The count of busy worker processes, shared with the master. */
+int worker_stats_create(void);
+int worker_busy(void);
+
+/* With 'worker_mode thread', the workers are threads of the conn process
+ * and the messages are passed by pointer through in-process queues. */
+int worker_threads_start(void *data);
+void worker_threads_stop(void);
+int worker_threads_push(shm_msg *msg, int len);
+int worker_threads_queued(void);
+void worker_threads_wake(int n);
+int worker_threads_pop(shm_msg **msg, int *len);
+
+/* Returns the token of the request being processed, it's only valid
+ * inside handle_process. If handle_process returns VERBEN_PENDING, the 
+ * token stays valid until it's passed to verben_reply(). */
+verben_req_t *verben_current(void);
+
+/* Send the deferred response of a request. The `flags' has the same
+ * meaning as the value returned by handle_process. The token can't be 
+ * used after this call. Returns 0 on success, otherwise -1. */
+int verben_reply(verben_req_t *req, const char *buf, int len, int flags);
+
+/* Returns `len' bytes to write the response of the request into, it's 
+ * sent without being copied when passed as the `sendbuf' of 
+ * handle_process, or the `buf' of verben_reply(). It's freed along with
+ * the response, handle_process_post isn't invoked on it. Calling it 
+ * again resizes the buffer, keeping its content. Returns NULL on 
+ * error. */
+char *verben_response_alloc(verben_req_t *req, int len);
+
+/* Allocate from the arena of the request. The memory is released all
+ * at once after handle_process_post, or by verben_reply() for a
+ * deferred response, don't free() it. Returns NULL on error. */
+void *verben_palloc(verben_req_t *req, size_t size);
+
+/* Copy up to `n' bytes of `s' into the arena, NUL-terminated. */
+char *verben_pstrndup(verben_req_t *req, const char *s, size_t n);
+
+/* Returns the id of the connection the request came from. Unlike the 
+ * request, it can be kept after the request is answered, to send data
+ * to the connection later. */
+verben_conn_t verben_conn_id(verben_req_t *req);
+
+/* Returns 1 if the connection of the request has been closed, so a long
+ * handler can give up, the response would be discarded. The requests of
+ * the closed connections still queued aren't processed. */
+int verben_cancelled(verben_req_t *req);
+
+/* Send data to the connection unasked, the pushes are dropped once it's
+ * closed, even when a new connection takes its slot. Returns 0 if queued
+ * to the conn process, otherwise -1. */
+int verben_push(verben_conn_t conn, const char *buf, int len);
+
+/* Add the connection to the group `group', or remove it, the groups 
+ * are created on the first join. A closed connection leaves all its 
+ * groups. The name is up to 64 bytes. */
+int verben_group_join(verben_conn_t conn, const char *group);
+int verben_group_leave(verben_conn_t conn, const char *group);
+
+/* Send data to all the members of the group, or to all the connections.
+ * The data is passed to the conn process once, whatever the number of
+ * the recipients. */
+int verben_group_push(const char *group, const char *buf, int len);
+int verben_broadcast(const char *buf, int len);
+
 #endif /* __WORKER_H_INCLUDED__ */
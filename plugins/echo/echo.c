@@ -54,7 +54,11 @@ int handle_input(char *buf, int len, const char *remote_ip, int port) {
 
 int handle_process(char *rcvbuf, int rcvlen, 
         char **sndbuf, int *sndlen, const char *remote_ip, int port) {
-    *sndbuf = (char *)malloc(rcvlen);
+    /* Write the response straight into the message sent back. */
+    *sndbuf = verben_response_alloc(verben_current(), rcvlen);
+    if (!*sndbuf) {
+        return VERBEN_ERROR;
+    }
     *sndlen = rcvlen;
 
     memcpy(*sndbuf, rcvbuf, rcvlen);
@@ -62,7 +66,8 @@ int handle_process(char *rcvbuf, int rcvlen,
 }
 
 /* This function used to free the memory allocated in handle_process().
- * It is NOT mandatory. */
+ * It is NOT mandatory, and not invoked on the buffers got from 
+ * verben_response_alloc(). */
 void handle_process_post(char *sendbuf, int sendlen) {
     if (sendbuf) {
         free(sendbuf);
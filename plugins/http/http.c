@@ -18,6 +18,13 @@
 #define HTTP_METHOD_HEAD    3
 
 #define RESPONSE_BUF_SIZE   4096
+#define REQUEST_MAX_SIZE    4096    /* the messages the conn process takes */
+
+/* The parse state of a connection, kept until the message is whole. */
+typedef struct http_conn {
+    int     header_len;     /* 0 until the end of the header is found */
+    int     content_len;    /* of the body, from Content-Length */
+} http_conn;
 
 void __http_plugin_main(void) {
     printf("** verben [http] plugin **\n");
@@ -63,30 +70,68 @@ int handle_open(char **sendbuf, int *len,
 */
 
 
-void handle_close(const char *remote_ip, int port) {
+int handle_open_v2(void **ctx, char **sendbuf, int *len, 
+        const char *remote_ip, int port) {
+    *ctx = calloc(1, sizeof(http_conn));
+    if (!*ctx) {
+        return VERBEN_ERROR;
+    }
+    *sendbuf = NULL;
+    return VERBEN_OK;
+}
+
+void handle_close_v2(void *ctx, const char *remote_ip, int port) {
     DEBUG_LOG("Connection from %s:%d closed", remote_ip, port);
+    free(ctx);
 }
 
-int handle_input(char *buf, int len, const char *remote_ip, int port) {
-    /* At here, try to find the end of the http request. */
-    int content_len;
+int handle_input_v2(void *ctx, const char *buf, int len, int *scanned,
+        const char *remote_ip, int port) {
+    /* At here, try to find the end of the http request. Only the new
+     * bytes are searched, with the 3 before them in case the CRLFs 
+     * are split. */
+    http_conn *hc = (http_conn *)ctx;
+    long content_len = 0;
+    int start;
     char *ptr;
     char *header_end;
-    if (!(header_end = strstr(buf, "\r\n\r\n"))) {
-        return 0;
-    }
-    header_end += 4;
-    /* find content-length header */
-    if ((ptr = strstr(buf, "Content-Length:"))) {
-        content_len = strtol(ptr + strlen("Content-Length:"), NULL, 10);
-        if (content_len == 0) {
-            ERROR_LOG("Invalid http protocol: %s", buf);
+
+    if (!hc->header_len) {
+        start = *scanned > 3 ? *scanned - 3 : 0;
+        header_end = memmem(buf + start, len - start, "\r\n\r\n", 4);
+        if (!header_end) {
+            *scanned = len;
+            return 0;
+        }
+
+        /* find content-length header */
+        ptr = memmem(buf, header_end - buf, "Content-Length:", 
+                strlen("Content-Length:"));
+        if (ptr) {
+            content_len = strtol(ptr + strlen("Content-Length:"), NULL, 10);
+            if (content_len <= 0) {
+                ERROR_LOG("Invalid http protocol: %.*s", len, buf);
+                return -1;
+            }
+        }
+        if (header_end + 4 - buf + content_len > REQUEST_MAX_SIZE) {
+            ERROR_LOG("Too large http request from %s:%d", remote_ip, port);
             return -1;
         }
-        return header_end - buf + content_len;
-    } else {
-        return header_end - buf;
+        hc->header_len = header_end + 4 - buf;
+        hc->content_len = content_len;
+    }
+
+    /* The header isn't scanned again while the body is coming. */
+    *scanned = len;
+    if (len < hc->header_len + hc->content_len) {
+        return 0;
     }
+
+    len = hc->header_len + hc->content_len;
+    hc->header_len = 0; /* the next message starts over */
+    hc->content_len = 0;
+    return len;
 }
 
 int handle_process(char *rcvbuf, int rcvlen, 
@@ -99,11 +144,14 @@ int handle_process(char *rcvbuf, int rcvlen,
     char *ptr2;
     char file[256] = {};
     int fd;
+    verben_req_t *req = verben_current();
     
-    /* copy the message, because of the recvbuf is not null-terminated. */
-    message = (char *)malloc(rcvlen + 1);
-    memcpy(message, rcvbuf, rcvlen);
-    message[rcvlen] = '\0';
+    /* copy the message, because of the recvbuf is not null-terminated.
+     * It's released along with the request. */
+    message = verben_pstrndup(req, rcvbuf, rcvlen);
+    if (!message) {
+        return VERBEN_ERROR;
+    }
 
     ptr = message;
     if (!strncmp(ptr, "GET", 3)) {  /* Only support method GET */
@@ -123,7 +171,6 @@ int handle_process(char *rcvbuf, int rcvlen,
     snprintf(file, sizeof(file), "%s/%s", doc_root, 
             (ptr[strlen(ptr) - 1] == '/') ? 
             index_file : ptr);
-    free(message);
 
     fd = open(file, O_RDONLY);
     if (fd < 0) {
@@ -133,7 +180,11 @@ int handle_process(char *rcvbuf, int rcvlen,
     file_size = lseek(fd, 0, SEEK_END);
     lseek(fd, 0, SEEK_SET);
 
-    *sndbuf = (char *)malloc(RESPONSE_BUF_SIZE);
+    *sndbuf = verben_response_alloc(req, RESPONSE_BUF_SIZE);
+    if (!*sndbuf) {
+        close(fd);
+        return VERBEN_ERROR;
+    }
     ptr = *sndbuf;
     ptr2 = *sndbuf + RESPONSE_BUF_SIZE;
     ptr += snprintf(ptr, ptr2 - ptr - 1, 
@@ -153,7 +204,8 @@ int handle_process(char *rcvbuf, int rcvlen,
 }
 
 /* This function used to free the memory allocated in handle_process().
- * It is NOT mandatory. */
+ * It is NOT mandatory, and not invoked on the buffers got from 
+ * verben_response_alloc(). */
 void handle_process_post(char *sendbuf, int sendlen) {
     if (sendbuf) {
         free(sendbuf);
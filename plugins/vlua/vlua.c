@@ -381,8 +381,14 @@ int handle_process(char *rcvbuf, int rcvlen,
         return ret;
     }
 
-    buf = (char *)malloc(*sndlen);
-    assert(buf);
+    /* Copied straight into the message sent back. */
+    buf = verben_response_alloc(verben_current(), *sndlen);
+    if (!buf) {
+        lua_pop(globalL, 2);
+        *sndbuf = NULL;
+        *sndlen = 0;
+        return VERBEN_ERROR;
+    }
     memcpy(buf, response, *sndlen);
     *sndbuf = buf;
     lua_pop(globalL, 2);
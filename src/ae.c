@@ -1,10 +1,35 @@
 /* A simple event-driven programming library. It's from Redis. */
+#define _GNU_SOURCE
+#define AE_NO_NAMES /* ae_create_*_event() are defined here */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <dlfcn.h>
 #include "ae.h"
 
+/* Operations of a multiplexing layer. Every layer defines one of it,
+   so the layer can be chosen at runtime. */
+typedef struct ae_api {
+    char *(*name)(void);
+    int edge;   /* whether edge-triggered notification is supported */
+    int (*create)(ae_event_loop *el);
+    void (*free)(ae_event_loop *el);
+    int (*add_event)(ae_event_loop *el, int fd, int mask);
+    void (*del_event)(ae_event_loop *el, int fd, int mask);
+    int (*poll)(ae_event_loop *el, struct timeval *tvp);
+    /* The completion-based I/O, NULL unless the layer supports it. */
+    int (*io_submit)(ae_event_loop *el, int op, int fd, char *buf, 
+            int len, ae_io_proc *proc, void *client_data);
+    void (*io_cancel)(ae_event_loop *el, int fd);
+    int (*io_complete)(ae_event_loop *el);
+} ae_api;
+
+#define AE_IO_ACCEPT    1
+#define AE_IO_RECV      2
+#define AE_IO_SEND      3
+
 /* Include the best multiplexing layer supported by this system.
    The following should be ordered by performances, descending. */
 /*
@@ -21,13 +46,41 @@
 
 #if defined(__linux__) 
 #include "ae_epoll.c"
+#define AE_API_DEFAULT  ae_epoll_api
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include "ae_io_uring.c"
+#endif
+#endif /* __has_include */
 #elif defined(__FreeBSD__)
 #include "ae_kqueue.c"
+#define AE_API_DEFAULT  ae_kqueue_api
 #else
 #include "ae_select.c"
+#define AE_API_DEFAULT  ae_select_api
 #endif
 
+/* The multiplexing layers can be chosen at runtime. */
+static ae_api *ae_apis[] = {
+#ifdef HAVE_IO_URING
+    &ae_io_uring_api,
+#ifdef AE_URING_COMPLETION
+    &ae_io_uring_completion_api,
+#endif /* AE_URING_COMPLETION */
+#endif /* HAVE_IO_URING */
+    &AE_API_DEFAULT,
+    NULL
+};
+
 ae_event_loop *ae_create_event_loop(void) {
+    return ae_create_event_loop_api(NULL);
+}
+
+/* Create an event loop on the multiplexing layer named 'api'. When
+   the layer is unknown or not supported by the running kernel, the
+   default one is used. Check ae_get_api_name() for the result. */
+ae_event_loop *ae_create_event_loop_api(const char *api) {
     ae_event_loop *el;
     int i;
 
@@ -38,23 +91,44 @@ ae_event_loop *ae_create_event_loop(void) {
     el->time_event_head = NULL;
     el->time_event_next_id = 0;
     el->maxfd = -1;
+    el->flags = 0;
+    el->npending = 0;
     el->before_sleep = NULL;
-    if (ae_api_create(el) == -1) {
-        free(el);
-        return NULL;
+    el->busy_poll_us = 0;
+    el->last_event_us = 0;
+    el->spin_proc = NULL;
+    memset(&el->stats, 0, sizeof(el->stats));
+    el->timing = NULL;
+    el->api = NULL;
+    for (i = 0; api && ae_apis[i]; ++i) {
+        if (!strcmp(ae_apis[i]->name(), api)) {
+            el->api = ae_apis[i];
+            break;
+        }
+    }
+
+    if (!el->api || el->api->create(el) == -1) {
+        el->api = &AE_API_DEFAULT;
+        if (el->api->create(el) == -1) {
+            free(el);
+            return NULL;
+        }
     }
 
     /* Events with mask == AE_NONE are not set. So let's initialize
        the vector with it. */
     for (i = 0; i < AE_SETSIZE; ++i) {
         el->events[i].mask = AE_NONE;
+        el->events[i].ready = AE_NONE;
+        el->events[i].pending = 0;
     }
     return el;
 }
 
 void ae_free_event_loop(ae_event_loop *el) {
     ae_time_event *te, *next;
-    ae_api_free(el);
+    el->api->free(el);
+    ae_disable_timing(el);
 
     /* Delete all time event to avoid memory leak. */
     te = el->time_event_head;
@@ -70,24 +144,48 @@ void ae_free_event_loop(ae_event_loop *el) {
     free(el);
 }
 
+/* Queue the fd to be dispatched again in the next iteration without
+   waiting for the kernel. In edge-triggered mode the kernel only 
+   reports a transition once, so the readiness not consumed by the 
+   handlers has to be remembered by ourselves. */
+static void ae_add_pending(ae_event_loop *el, int fd) {
+    ae_file_event *fe = &el->events[fd];
+    if (fe->pending) {
+        return;
+    }
+    fe->pending = 1;
+    el->pending[el->npending++] = fd;
+}
+
 /* Register a file event. */
 int ae_create_file_event(ae_event_loop *el, int fd, int mask,
         ae_file_proc *proc, void *client_data) {
+    return ae_create_file_event_named(el, fd, mask, proc, client_data, 
+            NULL);
+}
+
+int ae_create_file_event_named(ae_event_loop *el, int fd, int mask,
+        ae_file_proc *proc, void *client_data, const char *name) {
     if (fd >= AE_SETSIZE) {
         return AE_ERR;
     } 
     ae_file_event *fe = &el->events[fd];
 
-    if (ae_api_add_event(el, fd, mask) == -1) {
+    if (el->api->add_event(el, fd, mask) == -1) {
         return AE_ERR;
     }
+    if (fe->mask == AE_NONE) {
+        fe->ready = AE_NONE; /* A new fd, forget the old readiness. */
+    }
     fe->mask |= mask; /* On one fd, multi events can be registered. */
     if (mask & AE_READABLE) {
         fe->r_file_proc = proc;
+        fe->r_name = name;
     }
 
     if (mask & AE_WRITABLE) {
         fe->w_file_proc = proc;
+        fe->w_name = name;
     } 
     fe->client_data = client_data;
     /* Once one file event has been registered, the el->maxfd
@@ -95,6 +193,11 @@ int ae_create_file_event(ae_event_loop *el, int fd, int mask,
     if (fd > el->maxfd) {
         el->maxfd = fd;
     }
+    /* The kernel won't notify us again if the fd was already ready
+       before the interest was registered. */
+    if ((el->flags & AE_FLAG_EDGE) && (fe->ready & mask)) {
+        ae_add_pending(el, fd);
+    }
     return AE_OK;
 }
 
@@ -109,6 +212,9 @@ void ae_delete_file_event(ae_event_loop *el, int fd, int mask) {
         return;
     }
     fe->mask = fe->mask & (~mask);
+    if (fe->mask == AE_NONE) {
+        fe->ready = AE_NONE;
+    }
     if (fd == el->maxfd && fe->mask == AE_NONE) {
         /* All the events on the fd were deleted, update the max fd. */
         int j;
@@ -121,7 +227,17 @@ void ae_delete_file_event(ae_event_loop *el, int fd, int mask) {
            back to -1. */
         el->maxfd = j;
     }
-    ae_api_del_event(el, fd, mask);
+    el->api->del_event(el, fd, mask);
+}
+
+/* Called by the handlers in edge-triggered mode once the fd has been
+   drained (read or write returned EAGAIN). Until then, the fd is
+   dispatched again in every iteration. */
+void ae_clear_ready(ae_event_loop *el, int fd, int mask) {
+    if (fd >= AE_SETSIZE) {
+        return;
+    }
+    el->events[fd].ready &= ~mask;
 }
 
 int ae_get_file_events(ae_event_loop *el, int fd) {
@@ -140,6 +256,12 @@ static void ae_get_time(long *seconds, long *milliseconds) {
     *milliseconds = tv.tv_usec / 1000;
 }
 
+static long long ae_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void ae_add_milliseconds_to_now(long long milliseconds, 
         long *sec, long *ms) {
     long cur_sec, cur_ms, when_sec, when_ms;
@@ -159,6 +281,13 @@ static void ae_add_milliseconds_to_now(long long milliseconds,
 long long ae_create_time_event(ae_event_loop *el, long long ms, 
         ae_time_proc *proc, void *client_data,
         ae_event_finalizer_proc *finalizer_proc) {
+    return ae_create_time_event_named(el, ms, proc, client_data,
+            finalizer_proc, NULL);
+}
+
+long long ae_create_time_event_named(ae_event_loop *el, long long ms, 
+        ae_time_proc *proc, void *client_data,
+        ae_event_finalizer_proc *finalizer_proc, const char *name) {
     long long id = el->time_event_next_id++;
     ae_time_event *te;
     te = (ae_time_event*)malloc(sizeof(*te));
@@ -169,6 +298,7 @@ long long ae_create_time_event(ae_event_loop *el, long long ms,
     ae_add_milliseconds_to_now(ms, &te->when_sec, &te->when_ms);
     te->time_proc = proc;
     te->finalizer_proc = finalizer_proc;
+    te->name = name;
     te->client_data = client_data;
     /* Insert time event into the head of the linked list. */
     te->next = el->time_event_head;
@@ -231,10 +361,56 @@ static ae_time_event *ae_search_nearest_timer(ae_event_loop *el) {
 }
 
 /* Process time events. */
+static void ae_histogram_add(ae_histogram *h, long long us) {
+    int i = 0;
+
+    if (us < 0) {
+        us = 0;
+    }
+    while (i < AE_HIST_BUCKETS - 1 && (1LL << i) <= us) {
+        ++i;
+    }
+    ++h->buckets[i];
+    ++h->count;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+static void ae_report_slow(ae_event_loop *el, int fd, void *proc, 
+        const char *name, long long us) {
+    Dl_info info;
+
+    /* Without a name registered, only the exported symbols can be 
+       found, static handlers are reported by their address. */
+    if (!name && dladdr(proc, &info) && info.dli_saddr == proc) {
+        name = info.dli_sname;
+    }
+    el->timing->slow_proc(el, fd, proc, name, us);
+}
+
+static int ae_call_time_proc_timed(ae_event_loop *el, ae_time_event *te,
+        long long *time_us) {
+    ae_time_proc *proc = te->time_proc;
+    const char *name = te->name; /* the handler may delete the event */
+    long long start = ae_ustime(), us;
+    int ret;
+
+    ret = proc(el, te->id, te->client_data);
+    us = ae_ustime() - start;
+    *time_us += us;
+    if (el->timing->slow_proc && us >= el->timing->slow_us) {
+        ae_report_slow(el, -1, (void *)proc, name, us);
+    }
+    return ret;
+}
+
 static int process_time_events(ae_event_loop *el) {
     int processed = 0;
     ae_time_event *te;
     long long maxid;
+    long long time_us = 0;
 
     te = el->time_event_head;
     maxid = el->time_event_next_id - 1;
@@ -252,7 +428,11 @@ static int process_time_events(ae_event_loop *el) {
             (now_sec == te->when_sec && now_ms >= te->when_ms)) {
             int ret;
             id = te->id;
-            ret = te->time_proc(el, id, te->client_data);
+            if (el->timing) {
+                ret = ae_call_time_proc_timed(el, te, &time_us);
+            } else {
+                ret = te->time_proc(el, id, te->client_data);
+            }
             processed++;
             /* After an event is processed our time event list 
                may no longer be the same, so we restart from head.
@@ -279,9 +459,113 @@ static int process_time_events(ae_event_loop *el) {
             te = te->next;
         }
     }
+
+    if (el->timing && processed) {
+        ae_histogram_add(&el->timing->time, time_us);
+    }
     return processed;
 }
 
+/* Merge the fds reported by the kernel with the fds still ready from
+   the last iteration. Returns the new number of fired events. */
+static int ae_merge_pending(ae_event_loop *el, int numevents) {
+    int i, j;
+    ae_file_event *fe;
+
+    for (j = 0; j < numevents; ++j) {
+        fe = &el->events[el->fired[j].fd];
+        fe->ready |= el->fired[j].mask;
+        fe->pending = 0;
+        el->fired[j].mask = fe->ready;
+    }
+
+    for (i = 0; i < el->npending; ++i) {
+        fe = &el->events[el->pending[i]];
+        if (!fe->pending) {
+            continue; /* Already fired by the kernel. */
+        }
+        fe->pending = 0;
+        if (fe->ready & fe->mask) {
+            el->fired[numevents].fd = el->pending[i];
+            el->fired[numevents].mask = fe->ready;
+            ++numevents;
+        }
+    }
+    el->npending = 0;
+    return numevents;
+}
+
+/* Invoke the handlers of a fired file event. */
+static void ae_fire_file_event(ae_event_loop *el, int fd, int mask) {
+    ae_file_event *fe = &el->events[fd];
+    int rfired = 0;
+
+    /* Note the fe->mask & mask & ... code: maybe an already
+       processed event removed an element that fired and we
+       still didn't processed, so we check if the events is 
+       still valid. */
+    if (fe->mask & mask & AE_READABLE) {
+        rfired = 1;
+        fe->r_file_proc(el, fd, fe->client_data, mask);
+    } 
+    if (fe->mask & mask & AE_WRITABLE) {
+        if (!rfired || fe->w_file_proc != fe->r_file_proc) {
+            fe->w_file_proc(el, fd, fe->client_data, mask);
+        }
+    }
+
+    /* The handlers didn't drain the fd, try it again later. */
+    if ((el->flags & AE_FLAG_EDGE) && (fe->ready & fe->mask)) {
+        ae_add_pending(el, fd);
+    }
+}
+
+/* The timed version of polling and firing the file events, used when
+   the instrumentation is enabled. */
+static int ae_poll_timed(ae_event_loop *el, struct timeval *tvp) {
+    ae_timing *t = el->timing;
+    long long start, now, file_us = 0;
+    int j, numevents;
+
+    start = ae_ustime();
+    numevents = el->api->poll(el, tvp);
+    if (el->flags & AE_FLAG_EDGE) {
+        numevents = ae_merge_pending(el, numevents);
+    }
+    now = ae_ustime();
+    ae_histogram_add(&t->poll, now - start);
+
+    for (j = 0; j < numevents; ++j) {
+        ae_file_event *fe = &el->events[el->fired[j].fd];
+        /* Save it, the handler may unregister the event. */
+        int rfired = fe->mask & el->fired[j].mask & AE_READABLE;
+        void *proc = rfired ? 
+            (void *)fe->r_file_proc : (void *)fe->w_file_proc;
+        const char *name = rfired ? fe->r_name : fe->w_name;
+
+        start = now;
+        ae_fire_file_event(el, el->fired[j].fd, el->fired[j].mask);
+        now = ae_ustime();
+        file_us += now - start;
+        if (t->slow_proc && now - start >= t->slow_us) {
+            ae_report_slow(el, el->fired[j].fd, proc, name, 
+                    now - start);
+        }
+    }
+
+    /* The completions are accounted as a whole with the file events. */
+    if (el->api->io_complete) {
+        start = now;
+        numevents += el->api->io_complete(el);
+        file_us += ae_ustime() - start;
+    }
+
+    if (numevents) {
+        ae_histogram_add(&t->file, file_us);
+    }
+    return numevents;
+}
+
 /* Process every pending time event, then every pending file event
    (that may be registered by time event callbacks just processed).
    Without special flags the function sleeps until some file event
@@ -337,11 +621,15 @@ int ae_process_events(ae_event_loop *el, int flags) {
             if (tvp->tv_usec < 0) {
                 tvp->tv_usec = 0;
             }
+            if (el->npending) {
+                /* Some fds are still ready, don't sleep. */
+                tvp->tv_sec = tvp->tv_usec = 0;
+            }
         } else {
             /* If we have to check for events but need to return
                ASAP because of AE_DONT_WAIT we need to set the 
                timeout to zero. */
-            if (flags & AE_DONT_WAIT) {
+            if ((flags & AE_DONT_WAIT) || el->npending) {
                 tv.tv_sec = tv.tv_usec = 0;
                 tvp = &tv;
             } else {
@@ -349,28 +637,20 @@ int ae_process_events(ae_event_loop *el, int flags) {
                 tvp = NULL; /* wait forever */
             }
         }
-        numevents = ae_api_poll(el, tvp);
-        for (j = 0; j < numevents; ++j) {
-            ae_file_event *fe = &el->events[el->fired[j].fd];
-            int mask = el->fired[j].mask;
-            int fd = el->fired[j].fd;
-            int rfired = 0;
-            
-            /* Note the fe->mask & mask & ... code: maybe an already
-               processed event removed an element that fired and we
-               still didn't processed, so we check if the events is 
-               still valid. */
-            if (fe->mask & mask & AE_READABLE) {
-                rfired = 1;
-                fe->r_file_proc(el, fd, fe->client_data, mask);
-            } 
-            if (fe->mask & mask & AE_WRITABLE) {
-                if (!rfired || fe->w_file_proc != fe->r_file_proc) {
-                    fe->w_file_proc(el, fd, fe->client_data, mask);
-                }
+        if (el->timing) {
+            processed += ae_poll_timed(el, tvp);
+        } else {
+            numevents = el->api->poll(el, tvp);
+            if (el->flags & AE_FLAG_EDGE) {
+                numevents = ae_merge_pending(el, numevents);
+            }
+            for (j = 0; j < numevents; ++j) {
+                ae_fire_file_event(el, el->fired[j].fd, el->fired[j].mask);
+                ++processed;
+            }
+            if (el->api->io_complete) {
+                processed += el->api->io_complete(el);
             }
-
-            ++processed;
         }
     }
     /* Check time events */
@@ -413,18 +693,61 @@ int ae_wait(int fd, int mask, long long milliseconds) {
     }
 }
 
+/* One iteration in busy-polling mode. The loop keeps polling without 
+   waiting for up to el->busy_poll_us microseconds after the last event,
+   and only then blocks. The spin_proc is invoked in every spinning
+   iteration to check the sources without a fd (e.g. a shared memory
+   queue), and once with 'spinning' 0 before falling asleep, so the 
+   producers know they have to wake us up again. */
+static void ae_busy_poll(ae_event_loop *el) {
+    long long start = ae_ustime();
+    int processed;
+
+    ++el->stats.iterations;
+    if (start - el->last_event_us < el->busy_poll_us) {
+        ++el->stats.spin_polls;
+        processed = ae_process_events(el, AE_ALL_EVENTS | AE_DONT_WAIT);
+        if (el->spin_proc) {
+            processed += el->spin_proc(el, 1);
+        }
+        if (processed) {
+            ++el->stats.spin_hits;
+            el->last_event_us = start;
+        } else {
+            el->stats.spin_idle_us += ae_ustime() - start;
+        }
+        return;
+    }
+
+    /* Something may have arrived before the producers found that
+       we are sleeping. */
+    if (el->spin_proc && el->spin_proc(el, 0)) {
+        el->last_event_us = start;
+        return;
+    }
+
+    ++el->stats.blocks;
+    if (ae_process_events(el, AE_ALL_EVENTS)) {
+        el->last_event_us = ae_ustime();
+    }
+}
+
 /* main loop of the event-driven framework */
 void ae_main(ae_event_loop *el, int *quit) {
     while (!*quit) {
         if (el->before_sleep != NULL) {
             el->before_sleep(el);
         }
-        ae_process_events(el, AE_ALL_EVENTS);
+        if (el->busy_poll_us) {
+            ae_busy_poll(el);
+        } else {
+            ae_process_events(el, AE_ALL_EVENTS);
+        }
     }
 }
 
-char *ae_get_api_name(void) {
-    return ae_api_name();
+char *ae_get_api_name(ae_event_loop *el) {
+    return el->api->name();
 }
 
 void ae_set_before_sleep_proc(ae_event_loop *el, 
@@ -432,6 +755,146 @@ void ae_set_before_sleep_proc(ae_event_loop *el,
     el->before_sleep = before_sleep;
 }
 
+/* Enable busy-polling mode with a spin window of 'usec' microseconds,
+   0 to disable it. */
+void ae_set_busy_poll(ae_event_loop *el, long long usec, 
+        ae_spin_proc *spin_proc) {
+    el->busy_poll_us = usec;
+    el->spin_proc = spin_proc;
+}
+
+void ae_get_loop_stats(ae_event_loop *el, ae_loop_stats *stats, int reset) {
+    *stats = el->stats;
+    if (reset) {
+        memset(&el->stats, 0, sizeof(el->stats));
+    }
+}
+
+/* The completion-based I/O of the io_uring_completion layer: the
+   operations are queued and submitted together with the wait of the
+   next iteration, their completions are passed to 'proc' after the
+   file events. A recv is a single one, into a buffer lent by the layer
+   for the time of 'proc'. An accept stays armed until cancelled. The
+   buffer of a send must be valid until its completion. */
+int ae_io_supported(ae_event_loop *el) {
+    return el->api->io_submit != NULL;
+}
+
+int ae_io_accept(ae_event_loop *el, int fd, ae_io_proc *proc, 
+        void *client_data) {
+    if (!el->api->io_submit || el->api->io_submit(el, AE_IO_ACCEPT, fd,
+                NULL, 0, proc, client_data) == -1) {
+        return AE_ERR;
+    }
+    return AE_OK;
+}
+
+int ae_io_recv(ae_event_loop *el, int fd, ae_io_proc *proc, 
+        void *client_data) {
+    if (!el->api->io_submit || el->api->io_submit(el, AE_IO_RECV, fd,
+                NULL, 0, proc, client_data) == -1) {
+        return AE_ERR;
+    }
+    return AE_OK;
+}
+
+int ae_io_send(ae_event_loop *el, int fd, char *buf, int len, 
+        ae_io_proc *proc, void *client_data) {
+    if (!el->api->io_submit || el->api->io_submit(el, AE_IO_SEND, fd,
+                buf, len, proc, client_data) == -1) {
+        return AE_ERR;
+    }
+    return AE_OK;
+}
+
+/* Cancel the operations on the fd before closing it. */
+void ae_io_cancel(ae_event_loop *el, int fd) {
+    if (el->api->io_cancel) {
+        el->api->io_cancel(el, fd);
+    }
+}
+
+/* Record the time spent in polling, in file event callbacks and in 
+   time event callbacks per iteration into histograms. The callbacks
+   taking more than 'slow_us' microseconds are reported to 'slow_proc'
+   if it's not NULL. When disabled, it costs a single branch. */
+int ae_enable_timing(ae_event_loop *el, long long slow_us, 
+        ae_slow_proc *slow_proc) {
+    if (!el->timing) {
+        el->timing = (ae_timing *)malloc(sizeof(ae_timing));
+        if (!el->timing) {
+            return AE_ERR;
+        }
+        memset(el->timing, 0, sizeof(ae_timing));
+    }
+    el->timing->slow_us = slow_us;
+    el->timing->slow_proc = slow_proc;
+    return AE_OK;
+}
+
+void ae_disable_timing(ae_event_loop *el) {
+    if (el->timing) {
+        free(el->timing);
+        el->timing = NULL;
+    }
+}
+
+/* Copy the histograms out, and restart them if 'reset' is set. */
+int ae_get_timing(ae_event_loop *el, ae_timing *timing, int reset) {
+    if (!el->timing) {
+        return AE_ERR;
+    }
+    *timing = *el->timing;
+    if (reset) {
+        memset(&el->timing->poll, 0, sizeof(ae_histogram));
+        memset(&el->timing->file, 0, sizeof(ae_histogram));
+        memset(&el->timing->time, 0, sizeof(ae_histogram));
+    }
+    return AE_OK;
+}
+
+/* Returns the upper bound in microseconds of the bucket holding the
+   given percentile. */
+long long ae_histogram_percentile(ae_histogram *h, double percentile) {
+    unsigned long long seen = 0, rank;
+    int i;
+
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (unsigned long long)(h->count * percentile / 100);
+    for (i = 0; i < AE_HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+    if (i >= AE_HIST_BUCKETS - 1) {
+        return h->max_us;
+    }
+    return (1LL << i) - 1 < (long long)h->max_us ? 
+        (1LL << i) - 1 : (long long)h->max_us;
+}
+
+/* Switch the loop to edge-triggered notification. Interests are then
+   registered once for the lifetime of the fd, and the handlers are
+   expected to read/write until EAGAIN and call ae_clear_ready().
+   It must be called before any file event is registered. */
+int ae_set_edge_triggered(ae_event_loop *el, int on) {
+    if (el->maxfd != -1) {
+        return AE_ERR;
+    }
+    if (!on) {
+        el->flags &= ~AE_FLAG_EDGE;
+        return AE_OK;
+    }
+    if (!el->api->edge) {
+        return AE_ERR;
+    }
+    el->flags |= AE_FLAG_EDGE;
+    return AE_OK;
+}
+
 #ifdef AE_TEST_MAIN
 int print_timeout(ae_event_loop *el, long long id, void *client_data) {
     printf("Hello, AE!\n");
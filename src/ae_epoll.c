@@ -39,6 +39,16 @@ static int ae_api_add_event(ae_event_loop *el, int fd, int mask) {
     int op = el->events[fd].mask == AE_NONE ? 
         EPOLL_CTL_ADD : EPOLL_CTL_MOD;
     ee.events = 0;
+    if (el->flags & AE_FLAG_EDGE) {
+        /* Both interests are registered once for the lifetime of
+           the fd, so no more epoll_ctl(2) calls are needed when the
+           handlers toggle AE_WRITABLE. */
+        if (op == EPOLL_CTL_MOD) {
+            return 0;
+        }
+        mask = AE_READABLE | AE_WRITABLE;
+        ee.events = EPOLLET;
+    }
     mask |= el->events[fd].mask; /* Merge old events. */
     if (mask & AE_READABLE) {
         ee.events |= EPOLLIN;
@@ -59,6 +69,9 @@ static void ae_api_del_event(ae_event_loop *el, int fd, int delmask) {
     ae_api_state *state = el->api_data;
     struct epoll_event ee;
     int mask = el->events[fd].mask & (~delmask);
+    if ((el->flags & AE_FLAG_EDGE) && mask != AE_NONE) {
+        return; /* Keep watching both until the fd is unregistered. */
+    }
     ee.events = 0;
     if (mask & AE_READABLE) {
         ee.events |= EPOLLIN;
@@ -96,6 +109,13 @@ static int ae_api_poll(ae_event_loop *el, struct timeval *tvp) {
             if (e->events & EPOLLOUT) {
                 mask |= AE_WRITABLE;
             }
+
+            /* Errors are only reported once in edge-triggered mode,
+               let the handlers find them out. */
+            if ((el->flags & AE_FLAG_EDGE) &&
+                    (e->events & (EPOLLERR | EPOLLHUP))) {
+                mask |= AE_READABLE | AE_WRITABLE;
+            }
             el->fired[j].fd = e->data.fd;
             el->fired[j].mask = mask;
         }
@@ -106,3 +126,16 @@ static int ae_api_poll(ae_event_loop *el, struct timeval *tvp) {
 static char *ae_api_name(void) {
     return "epoll";
 }
+
+static ae_api ae_epoll_api = {
+    .name = ae_api_name,
+    .edge = 1,
+    .create = ae_api_create,
+    .free = ae_api_free,
+    .add_event = ae_api_add_event,
+    .del_event = ae_api_del_event,
+    .poll = ae_api_poll,
+    .io_submit = NULL,
+    .io_cancel = NULL,
+    .io_complete = NULL
+};
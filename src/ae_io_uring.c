@@ -0,0 +1,718 @@
+/* Linux io_uring(7) based ae.c module.
+
+   The readiness of the fds is polled with IORING_OP_POLL_ADD. The
+   interest changes are only queued in the submission ring, they are
+   submitted together with the wait in one io_uring_enter(2) per loop
+   iteration. In edge-triggered mode the polls are multishot, so they
+   are armed once for the lifetime of the fd.
+
+   The io_uring_completion layer also submits accept, recv and send
+   themselves, see ae_io_accept(). The recv picks a buffer from a ring
+   registered to the kernel, so no buffer is pinned by an idle fd. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define AE_URING_ENTRIES    4096
+#define AE_URING_REMOVE     (~0ULL) /* user_data of the POLL_REMOVE */
+/* The user_data of a poll has the top bit set, the seq and the fd. The
+   other operations have their ae_uring_op as user_data. */
+#define AE_URING_POLL       (1ULL << 63)
+#define AE_URING_SEQ_MASK   0x7FFFFFFF
+#define AE_URING_POLL_DATA(seq, fd) (AE_URING_POLL | \
+        ((unsigned long long)((seq) & AE_URING_SEQ_MASK) << 32) | (fd))
+
+/* Multishot accept and the ring of provided buffers came together in
+   Linux 5.19. */
+#ifdef IORING_ACCEPT_MULTISHOT
+#define AE_URING_COMPLETION
+#endif /* IORING_ACCEPT_MULTISHOT */
+
+#define AE_URING_BGID       0       /* buffer group of the recv */
+#define AE_URING_NBUFS      1024    /* a power of 2 */
+#define AE_URING_BUF_SIZE   4096
+
+/* An accept, recv or send in flight */
+typedef struct ae_uring_op {
+    int         op;         /* AE_IO_* */
+    int         fd;
+    int         cancelled;
+    ae_io_proc  *proc;
+    void        *client_data;
+    char        *buf;       /* of the send */
+    int         len;
+    struct ae_uring_op *prev;   /* in flight on the same fd */
+    struct ae_uring_op *next;
+} ae_uring_op;
+
+typedef struct ae_uring_done {
+    ae_uring_op *op;
+    int         res;
+    unsigned    flags;
+} ae_uring_done;
+
+typedef struct ae_uring_state {
+    int         ring_fd;
+    unsigned    *sq_head;
+    unsigned    *sq_tail;
+    unsigned    *sq_mask;
+    unsigned    *sq_array;
+    unsigned    sq_entries;
+    unsigned    sqe_tail;   /* local tail, published before submitting */
+    unsigned    *cq_head;
+    unsigned    *cq_tail;
+    unsigned    *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void        *sq_ptr;
+    size_t      sq_len;
+    void        *cq_ptr;
+    size_t      cq_len;
+    size_t      sqes_len;
+    int         armed[AE_SETSIZE];  /* AE mask polled in the kernel */
+    unsigned    seq[AE_SETSIZE];    /* filters completions of old polls */
+    int         slot[AE_SETSIZE];   /* index in el->fired, or -1 */
+    char        rearm[AE_SETSIZE];
+    int         nrearm;
+    int         rearms[AE_SETSIZE]; /* fds whose oneshot poll completed */
+    unsigned    cq_entries;
+    /* The completion layer only */
+    int         completion;
+    ae_uring_op *ops[AE_SETSIZE];   /* in flight, per fd */
+    ae_uring_op *free_ops;
+    ae_uring_done *done;            /* reaped, not dispatched yet */
+    int         ndone;
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char        *bufs;
+} ae_uring_state;
+
+static int ae_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, arg, argsz);
+}
+
+static void ae_uring_unmap(ae_uring_state *state) {
+    if (state->sqes && state->sqes != MAP_FAILED) {
+        munmap(state->sqes, state->sqes_len);
+    }
+    if (state->cq_ptr && state->cq_ptr != MAP_FAILED &&
+            state->cq_ptr != state->sq_ptr) {
+        munmap(state->cq_ptr, state->cq_len);
+    }
+    if (state->sq_ptr && state->sq_ptr != MAP_FAILED) {
+        munmap(state->sq_ptr, state->sq_len);
+    }
+}
+
+static int ae_uring_create(ae_event_loop *el) {
+    struct io_uring_params p;
+    ae_uring_state *state;
+    char *sq, *cq;
+    int i;
+
+    state = malloc(sizeof(*state));
+    if (!state) {
+        return -1;
+    }
+    memset(state, 0, sizeof(*state));
+
+    memset(&p, 0, sizeof(p));
+    state->ring_fd = syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p);
+    if (state->ring_fd == -1) {
+        free(state);
+        return -1;
+    }
+
+    /* The timeout of io_uring_enter(2) is needed to wait for the
+       nearest timer. */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(state->ring_fd);
+        free(state);
+        return -1;
+    }
+
+    state->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state->cq_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_len > state->sq_len) {
+            state->sq_len = state->cq_len;
+        }
+        state->cq_len = state->sq_len;
+    }
+
+    state->sq_ptr = mmap(NULL, state->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) {
+        goto failed;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ptr = state->sq_ptr;
+    } else {
+        state->cq_ptr = mmap(NULL, state->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) {
+            goto failed;
+        }
+    }
+
+    state->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, state->ring_fd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        goto failed;
+    }
+
+    sq = state->sq_ptr;
+    cq = state->cq_ptr;
+    state->sq_head = (unsigned *)(sq + p.sq_off.head);
+    state->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    state->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    state->sq_array = (unsigned *)(sq + p.sq_off.array);
+    state->sq_entries = p.sq_entries;
+    state->sqe_tail = *state->sq_tail;
+    state->cq_head = (unsigned *)(cq + p.cq_off.head);
+    state->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    state->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    state->cq_entries = p.cq_entries;
+
+    for (i = 0; i < AE_SETSIZE; ++i) {
+        state->slot[i] = -1;
+    }
+    el->api_data = state;
+    return 0;
+
+failed:
+    ae_uring_unmap(state);
+    close(state->ring_fd);
+    free(state);
+    return -1;
+}
+
+static void ae_uring_free_ops(ae_uring_state *state);
+
+static void ae_uring_free(ae_event_loop *el) {
+    ae_uring_state *state = el->api_data;
+    ae_uring_free_ops(state);
+    ae_uring_unmap(state);
+    close(state->ring_fd);
+    free(state);
+}
+
+/* Publish the queued submissions to the kernel. Returns the number
+   of entries the kernel has not consumed yet. */
+static unsigned ae_uring_flush(ae_uring_state *state) {
+    __atomic_store_n(state->sq_tail, state->sqe_tail, __ATOMIC_RELEASE);
+    return state->sqe_tail -
+        __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe *ae_uring_get_sqe(ae_uring_state *state) {
+    struct io_uring_sqe *sqe;
+    unsigned head, idx;
+
+    head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+    if (state->sqe_tail - head >= state->sq_entries) {
+        /* The submission ring is full, submit it without waiting. */
+        if (ae_uring_enter(state->ring_fd, ae_uring_flush(state),
+                    0, 0, NULL, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+        if (state->sqe_tail - head >= state->sq_entries) {
+            return NULL;
+        }
+    }
+
+    idx = state->sqe_tail & *state->sq_mask;
+    sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    ++state->sqe_tail;
+    return sqe;
+}
+
+static int ae_uring_arm(ae_event_loop *el, int fd, int mask) {
+    ae_uring_state *state = el->api_data;
+    struct io_uring_sqe *sqe;
+    unsigned events = 0;
+
+    if (!(sqe = ae_uring_get_sqe(state))) {
+        return -1;
+    }
+    if (mask & AE_READABLE) {
+        events |= POLLIN;
+    }
+    if (mask & AE_WRITABLE) {
+        events |= POLLOUT;
+    }
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif /* __BIG_ENDIAN */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    if (el->flags & AE_FLAG_EDGE) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = AE_URING_POLL_DATA(state->seq[fd], fd);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+static void ae_uring_disarm(ae_event_loop *el, int fd) {
+    ae_uring_state *state = el->api_data;
+    struct io_uring_sqe *sqe;
+
+    if (state->armed[fd] == AE_NONE) {
+        return;
+    }
+    if ((sqe = ae_uring_get_sqe(state))) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = AE_URING_POLL_DATA(state->seq[fd], fd);
+        sqe->user_data = AE_URING_REMOVE;
+    }
+    /* Completions of the removed poll will be ignored. */
+    ++state->seq[fd];
+    state->armed[fd] = AE_NONE;
+}
+
+static int ae_uring_add_event(ae_event_loop *el, int fd, int mask) {
+    mask |= el->events[fd].mask; /* Merge old events. */
+    if (el->flags & AE_FLAG_EDGE) {
+        /* Both interests are polled for the lifetime of the fd. */
+        if (el->events[fd].mask != AE_NONE) {
+            return 0;
+        }
+        mask = AE_READABLE | AE_WRITABLE;
+    }
+    ae_uring_disarm(el, fd);
+    return ae_uring_arm(el, fd, mask);
+}
+
+static void ae_uring_del_event(ae_event_loop *el, int fd, int delmask) {
+    int mask = el->events[fd].mask & (~delmask);
+    if ((el->flags & AE_FLAG_EDGE) && mask != AE_NONE) {
+        return; /* Keep polling both until the fd is unregistered. */
+    }
+
+    /* Removing the poll at once also releases the file reference held
+       by the kernel, so that a closed socket is really closed. */
+    ae_uring_disarm(el, fd);
+    if (mask != AE_NONE) {
+        ae_uring_arm(el, fd, mask);
+    }
+}
+
+static int ae_uring_poll(ae_event_loop *el, struct timeval *tvp) {
+    ae_uring_state *state = el->api_data;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, to_submit, wait_nr, flags;
+    int numevents = 0;
+    int i, fd, mask;
+
+    /* Arm again the oneshot polls completed in the last iteration,
+       with the interest left by the handlers. */
+    for (i = 0; i < state->nrearm; ++i) {
+        fd = state->rearms[i];
+        state->rearm[fd] = 0;
+        if (state->armed[fd] == AE_NONE &&
+                el->events[fd].mask != AE_NONE) {
+            ae_uring_arm(el, fd, (el->flags & AE_FLAG_EDGE) ?
+                    AE_READABLE | AE_WRITABLE : el->events[fd].mask);
+        }
+    }
+    state->nrearm = 0;
+
+    to_submit = ae_uring_flush(state);
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    wait_nr = 1;
+    if (head != tail || (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0)) {
+        wait_nr = 0;
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    flags = IORING_ENTER_EXT_ARG;
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if ((to_submit || wait_nr) && ae_uring_enter(state->ring_fd,
+                to_submit, wait_nr, flags, &arg, sizeof(arg)) == -1) {
+        if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+            return 0;
+        }
+    }
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; ++head) {
+        cqe = &state->cqes[head & *state->cq_mask];
+        if (cqe->user_data == AE_URING_REMOVE) {
+            continue;
+        }
+        if (!(cqe->user_data & AE_URING_POLL)) {
+            /* Dispatched by ae_uring_io_complete() after the file
+               events, the rest is left for the next iteration. */
+            if (state->ndone == (int)state->cq_entries) {
+                break;
+            }
+            state->done[state->ndone].op = 
+                (ae_uring_op *)(uintptr_t)cqe->user_data;
+            state->done[state->ndone].res = cqe->res;
+            state->done[state->ndone].flags = cqe->flags;
+            ++state->ndone;
+            continue;
+        }
+        fd = (int)(cqe->user_data & 0xFFFFFFFF);
+        if (fd >= AE_SETSIZE || ((cqe->user_data >> 32) & 
+                    AE_URING_SEQ_MASK) != (state->seq[fd] & AE_URING_SEQ_MASK)) {
+            continue; /* The poll has been removed. */
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            /* The poll is finished and must be armed again. */
+            state->armed[fd] = AE_NONE;
+            if (!state->rearm[fd]) {
+                state->rearm[fd] = 1;
+                state->rearms[state->nrearm++] = fd;
+            }
+        }
+
+        if (cqe->res == -ECANCELED) {
+            continue;
+        }
+
+        mask = 0;
+        if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
+            mask |= AE_READABLE | AE_WRITABLE;
+        } else {
+            if (cqe->res & POLLIN) {
+                mask |= AE_READABLE;
+            }
+            if (cqe->res & POLLOUT) {
+                mask |= AE_WRITABLE;
+            }
+        }
+
+        /* Multishot polls may complete many times in one iteration. */
+        if (state->slot[fd] == -1) {
+            state->slot[fd] = numevents;
+            el->fired[numevents].fd = fd;
+            el->fired[numevents].mask = mask;
+            ++numevents;
+        } else {
+            el->fired[state->slot[fd]].mask |= mask;
+        }
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+
+    for (i = 0; i < numevents; ++i) {
+        state->slot[el->fired[i].fd] = -1;
+    }
+    return numevents;
+}
+
+static char *ae_uring_name(void) {
+    return "io_uring";
+}
+
+static ae_api ae_io_uring_api = {
+    .name = ae_uring_name,
+    .edge = 1,
+    .create = ae_uring_create,
+    .free = ae_uring_free,
+    .add_event = ae_uring_add_event,
+    .del_event = ae_uring_del_event,
+    .poll = ae_uring_poll,
+    .io_submit = NULL,
+    .io_cancel = NULL,
+    .io_complete = NULL
+};
+
+#ifdef AE_URING_COMPLETION
+static void ae_uring_put_buf(ae_uring_state *state, int bid) {
+    struct io_uring_buf *buf;
+
+    buf = &state->br->bufs[state->br_tail & (AE_URING_NBUFS - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)
+        (state->bufs + (size_t)bid * AE_URING_BUF_SIZE);
+    buf->len = AE_URING_BUF_SIZE;
+    buf->bid = bid;
+    ++state->br_tail;
+}
+
+static int ae_uring_create_completion(ae_event_loop *el) {
+    ae_uring_state *state;
+    struct io_uring_buf_reg reg;
+    size_t br_len = AE_URING_NBUFS * sizeof(struct io_uring_buf);
+    int i;
+
+    if (ae_uring_create(el) == -1) {
+        return -1;
+    }
+    state = el->api_data;
+    state->completion = 1;
+
+    /* The buffers are only touched as the recvs fill them. */
+    state->done = malloc(sizeof(ae_uring_done) * state->cq_entries);
+    state->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    state->bufs = mmap(NULL, (size_t)AE_URING_NBUFS * AE_URING_BUF_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!state->done || state->br == MAP_FAILED 
+            || state->bufs == MAP_FAILED) {
+        goto failed;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)state->br;
+    reg.ring_entries = AE_URING_NBUFS;
+    reg.bgid = AE_URING_BGID;
+    if (syscall(__NR_io_uring_register, state->ring_fd, 
+                IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        goto failed; /* before Linux 5.19 */
+    }
+
+    for (i = 0; i < AE_URING_NBUFS; ++i) {
+        ae_uring_put_buf(state, i);
+    }
+    __atomic_store_n(&state->br->tail, state->br_tail, __ATOMIC_RELEASE);
+    return 0;
+
+failed:
+    ae_uring_free(el);
+    return -1;
+}
+
+static void ae_uring_free_ops(ae_uring_state *state) {
+    ae_uring_op *op, *next;
+    int fd;
+
+    if (!state->completion) {
+        return;
+    }
+    /* The kernel is done with the buffers once the ring is closed. */
+    for (fd = 0; fd < AE_SETSIZE; ++fd) {
+        for (op = state->ops[fd]; op; op = next) {
+            next = op->next;
+            free(op);
+        }
+    }
+    for (op = state->free_ops; op; op = next) {
+        next = op->next;
+        free(op);
+    }
+    free(state->done);
+    if (state->br && state->br != MAP_FAILED) {
+        munmap(state->br, AE_URING_NBUFS * sizeof(struct io_uring_buf));
+    }
+    if (state->bufs && state->bufs != MAP_FAILED) {
+        munmap(state->bufs, (size_t)AE_URING_NBUFS * AE_URING_BUF_SIZE);
+    }
+}
+
+static int ae_uring_io_arm(ae_uring_state *state, ae_uring_op *op) {
+    struct io_uring_sqe *sqe;
+
+    if (!(sqe = ae_uring_get_sqe(state))) {
+        return -1;
+    }
+    sqe->fd = op->fd;
+    switch (op->op) {
+    case AE_IO_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        break;
+    case AE_IO_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = AE_URING_BGID;
+        break;
+    case AE_IO_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+        sqe->len = op->len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    }
+    sqe->user_data = (unsigned long long)(uintptr_t)op;
+    return 0;
+}
+
+static void ae_uring_io_unlink(ae_uring_state *state, ae_uring_op *op) {
+    if (op->cancelled) {
+        return; /* not in the list any more */
+    }
+    if (op->prev) {
+        op->prev->next = op->next;
+    } else {
+        state->ops[op->fd] = op->next;
+    }
+    if (op->next) {
+        op->next->prev = op->prev;
+    }
+}
+
+static void ae_uring_io_free(ae_uring_state *state, ae_uring_op *op) {
+    op->next = state->free_ops;
+    state->free_ops = op;
+}
+
+static int ae_uring_io_submit(ae_event_loop *el, int type, int fd, 
+        char *buf, int len, ae_io_proc *proc, void *client_data) {
+    ae_uring_state *state = el->api_data;
+    ae_uring_op *op;
+
+    if (fd >= AE_SETSIZE) {
+        return -1;
+    }
+    if ((op = state->free_ops)) {
+        state->free_ops = op->next;
+    } else if (!(op = malloc(sizeof(*op)))) {
+        return -1;
+    }
+    op->op = type;
+    op->fd = fd;
+    op->cancelled = 0;
+    op->proc = proc;
+    op->client_data = client_data;
+    op->buf = buf;
+    op->len = len;
+    if (ae_uring_io_arm(state, op) == -1) {
+        ae_uring_io_free(state, op);
+        return -1;
+    }
+
+    op->prev = NULL;
+    op->next = state->ops[fd];
+    if (op->next) {
+        op->next->prev = op;
+    }
+    state->ops[fd] = op;
+    return 0;
+}
+
+/* The cancellations are submitted at once, the fd is about to be closed
+   and may be reused by the operations queued after. */
+static void ae_uring_io_cancel(ae_event_loop *el, int fd) {
+    ae_uring_state *state = el->api_data;
+    struct io_uring_sqe *sqe;
+    ae_uring_op *op;
+
+    if (fd >= AE_SETSIZE || !state->ops[fd]) {
+        return;
+    }
+    for (op = state->ops[fd]; op; op = op->next) {
+        op->cancelled = 1;
+        if ((sqe = ae_uring_get_sqe(state))) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long long)(uintptr_t)op;
+            sqe->user_data = AE_URING_REMOVE;
+        }
+    }
+    state->ops[fd] = NULL;
+    ae_uring_enter(state->ring_fd, ae_uring_flush(state), 0, 0, NULL, 0);
+}
+
+/* Dispatch the completions reaped by the last poll. Returns the number
+   of them. */
+static int ae_uring_io_complete(ae_event_loop *el) {
+    ae_uring_state *state = el->api_data;
+    ae_uring_done *done;
+    ae_uring_op *op;
+    char *buf;
+    int i, n = state->ndone, more, bid;
+
+    state->ndone = 0;
+    for (i = 0; i < n; ++i) {
+        done = &state->done[i];
+        op = done->op;
+        more = done->flags & IORING_CQE_F_MORE;
+        buf = op->buf;
+        bid = -1;
+        if (done->flags & IORING_CQE_F_BUFFER) {
+            bid = done->flags >> IORING_CQE_BUFFER_SHIFT;
+            buf = state->bufs + (size_t)bid * AE_URING_BUF_SIZE;
+        }
+
+        /* Out of buffers for the moment, they are given back below, 
+           or nothing to accept after all. Try it again. */
+        if (!op->cancelled && !more && (done->res == -ENOBUFS || 
+                    done->res == -EAGAIN)) {
+            if (ae_uring_io_arm(state, op) == 0) {
+                continue;
+            }
+            done->res = -ENOBUFS;
+        }
+
+        /* The accept is armed again unless it fails. */
+        if (!more && op->op != AE_IO_ACCEPT) {
+            ae_uring_io_unlink(state, op);
+        }
+        op->proc(el, op->cancelled ? -1 : op->fd, op->client_data, 
+                done->res, buf);
+        if (bid != -1) {
+            ae_uring_put_buf(state, bid);
+        }
+        if (more) {
+            continue;
+        }
+        if (op->op == AE_IO_ACCEPT) {
+            if (!op->cancelled && ae_uring_io_arm(state, op) == 0) {
+                continue;
+            }
+            ae_uring_io_unlink(state, op);
+        }
+        ae_uring_io_free(state, op);
+    }
+    __atomic_store_n(&state->br->tail, state->br_tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+static char *ae_uring_completion_name(void) {
+    return "io_uring_completion";
+}
+
+static ae_api ae_io_uring_completion_api = {
+    .name = ae_uring_completion_name,
+    .edge = 1,
+    .create = ae_uring_create_completion,
+    .free = ae_uring_free,
+    .add_event = ae_uring_add_event,
+    .del_event = ae_uring_del_event,
+    .poll = ae_uring_poll,
+    .io_submit = ae_uring_io_submit,
+    .io_cancel = ae_uring_io_cancel,
+    .io_complete = ae_uring_io_complete
+};
+#else
+static void ae_uring_free_ops(ae_uring_state *state) {
+    AE_NOTUSED(state);
+}
+#endif /* AE_URING_COMPLETION */
@@ -97,3 +97,16 @@ static int ae_api_poll(ae_event_loop *el, struct timeval *tvp) {
 static char *ae_api_name(void) {
     return "kqueue";
 }
+
+static ae_api ae_kqueue_api = {
+    .name = ae_api_name,
+    .edge = 0,
+    .create = ae_api_create,
+    .free = ae_api_free,
+    .add_event = ae_api_add_event,
+    .del_event = ae_api_del_event,
+    .poll = ae_api_poll,
+    .io_submit = NULL,
+    .io_cancel = NULL,
+    .io_complete = NULL
+};
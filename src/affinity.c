@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+#include "log.h"
+
+#define MAX_NODES           64
+#define CPU_LIST_LEN        256
+
+/* From <numaif.h>, to do without libnuma. */
+#define MPOL_PREFERRED      1
+#define MPOL_MF_MOVE        (1 << 1)
+
+static cpu_set_t    conn_set;
+static int          conn_pinned;
+static int          *worker_cpus;
+static int          nworker_cpus;
+static int          numa_node = -1;
+static int          numa_bind;
+static cpu_set_t    node_sets[MAX_NODES];
+static int          nnodes;
+
+/* Parse a CPU list like "0,2-5". */
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*p) {
+        while (isspace(*p) || *p == ',') {
+            ++p;
+        }
+        if (!*p) {
+            break;
+        }
+
+        lo = strtol(p, &end, 10);
+        if (end == p) {
+            return -1;
+        }
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p) {
+                return -1;
+            }
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+            return -1;
+        }
+        for ( ; lo <= hi; ++lo) {
+            CPU_SET(lo, set);
+        }
+        p = end;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int read_sysfs(const char *path, char *buf, int len) {
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r"))) {
+        return -1;
+    }
+    if (!fgets(buf, len, fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void load_nodes(void) {
+    char path[128];
+    char buf[CPU_LIST_LEN];
+    int n;
+
+    for (n = 0; n < MAX_NODES; ++n) {
+        snprintf(path, sizeof(path),
+                "/sys/devices/system/node/node%d/cpulist", n);
+        if (read_sysfs(path, buf, sizeof(buf)) != 0
+                || parse_cpu_list(buf, &node_sets[n]) != 0) {
+            CPU_ZERO(&node_sets[n]);
+            continue;
+        }
+        nnodes = n + 1;
+    }
+}
+
+static int cpu_node(int cpu) {
+    int n;
+
+    for (n = 0; n < nnodes; ++n) {
+        if (CPU_ISSET(cpu, &node_sets[n])) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/* CPUs with the same core are hyperthread siblings. */
+static int cpu_core(int cpu) {
+    char path[128];
+    char buf[32];
+    int package, core;
+
+    snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+            cpu);
+    if (read_sysfs(path, buf, sizeof(buf)) != 0) {
+        return cpu | (1 << 30);
+    }
+    package = atoi(buf);
+
+    snprintf(path, sizeof(path),
+            "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+    if (read_sysfs(path, buf, sizeof(buf)) != 0) {
+        return cpu | (1 << 30);
+    }
+    core = atoi(buf);
+    return (package << 16) | core;
+}
+
+static int first_cpu(cpu_set_t *set) {
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, set)) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* The node with the most CPUs we are allowed to run on. */
+static int busiest_node(cpu_set_t *allowed) {
+    cpu_set_t and;
+    int n, best = -1, count, max = 0;
+
+    for (n = 0; n < nnodes; ++n) {
+        CPU_AND(&and, &node_sets[n], allowed);
+        count = CPU_COUNT(&and);
+        if (count > max) {
+            max = count;
+            best = n;
+        }
+    }
+    return best;
+}
+
+/* One worker per physical core first, skipping the core of the conn
+ * process, then the hyperthread siblings. */
+static int auto_workers(cpu_set_t *cand, int conn_cpu) {
+    int *cores;
+    int ncores = 0;
+    int cpu, core, i;
+    cpu_set_t used;
+
+    worker_cpus = (int *)malloc(sizeof(int) * (CPU_COUNT(cand) + 1));
+    cores = (int *)malloc(sizeof(int) * (CPU_COUNT(cand) + 1));
+    if (!worker_cpus || !cores) {
+        free(cores);
+        return -1;
+    }
+
+    CPU_ZERO(&used);
+    cores[ncores++] = cpu_core(conn_cpu);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, cand)) {
+            continue;
+        }
+        core = cpu_core(cpu);
+        for (i = 0; i < ncores && cores[i] != core; ++i) {
+            /* Seen the core already? */
+        }
+        if (i == ncores) {
+            cores[ncores++] = core;
+            worker_cpus[nworker_cpus++] = cpu;
+            CPU_SET(cpu, &used);
+        }
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, cand) && !CPU_ISSET(cpu, &used)
+                && cpu != conn_cpu) {
+            worker_cpus[nworker_cpus++] = cpu;
+        }
+    }
+
+    if (nworker_cpus == 0) {
+        /* A single CPU, share it. */
+        worker_cpus[nworker_cpus++] = conn_cpu;
+    }
+    free(cores);
+    return 0;
+}
+
+static void format_cpus(int *cpus, int n, char *buf, int len) {
+    int i, pos = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < n && pos < len; ++i) {
+        pos += snprintf(buf + pos, len - pos, i ? ",%d" : "%d", cpus[i]);
+    }
+}
+
+int affinity_init(conf_t *conf) {
+    char *conn_conf = conf_get_str_value(conf, "conn_cpu", NULL);
+    char *worker_conf = conf_get_str_value(conf, "worker_cpus", NULL);
+    char conn_buf[CPU_LIST_LEN], worker_buf[CPU_LIST_LEN];
+    cpu_set_t allowed, cand, set;
+    int conn_cpus[CPU_SETSIZE];
+    int conn_cpu, cpu, i;
+
+    numa_bind = conf_get_int_value(conf, "numa_bind", 0);
+    if (!conn_conf && !worker_conf && !numa_bind) {
+        return 0;
+    }
+
+    load_nodes();
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        boot_notify(-1, "Get CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    /* The node is the one of the conn process, the workers are kept on
+     * the same socket. */
+    if (conn_conf && strcmp(conn_conf, "auto")) {
+        if (parse_cpu_list(conn_conf, &conn_set) != 0) {
+            boot_notify(-1, "Invalid conn_cpu: %s", conn_conf);
+            return -1;
+        }
+        conn_cpu = first_cpu(&conn_set);
+        numa_node = cpu_node(conn_cpu);
+    } else {
+        numa_node = busiest_node(&allowed);
+        if (numa_node >= 0) {
+            CPU_AND(&cand, &node_sets[numa_node], &allowed);
+        } else {
+            cand = allowed;
+        }
+        conn_cpu = first_cpu(&cand);
+        CPU_ZERO(&conn_set);
+        CPU_SET(conn_cpu, &conn_set);
+    }
+    conn_pinned = conn_conf != NULL;
+
+    if (worker_conf && !strcmp(worker_conf, "auto")) {
+        if (numa_node >= 0) {
+            CPU_AND(&cand, &node_sets[numa_node], &allowed);
+        } else {
+            cand = allowed;
+        }
+        if (auto_workers(&cand, conn_cpu) != 0) {
+            boot_notify(-1, "Lay out worker CPUs");
+            return -1;
+        }
+    } else if (worker_conf) {
+        if (parse_cpu_list(worker_conf, &set) != 0) {
+            boot_notify(-1, "Invalid worker_cpus: %s", worker_conf);
+            return -1;
+        }
+        worker_cpus = (int *)malloc(sizeof(int) * CPU_COUNT(&set));
+        if (!worker_cpus) {
+            return -1;
+        }
+        for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                worker_cpus[nworker_cpus++] = cpu;
+            }
+        }
+    }
+
+    for (cpu = 0, i = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &conn_set)) {
+            conn_cpus[i++] = cpu;
+        }
+    }
+    format_cpus(conn_cpus, i, conn_buf, sizeof(conn_buf));
+    format_cpus(worker_cpus, nworker_cpus, worker_buf, sizeof(worker_buf));
+
+    boot_notify(0, "CPU affinity: conn [%s], workers [%s], node %d",
+            conn_pinned ? conn_buf : "any",
+            nworker_cpus ? worker_buf : "any", numa_node);
+    NOTICE_LOG("CPU affinity: conn [%s], workers [%s], node %d%s",
+            conn_pinned ? conn_buf : "any",
+            nworker_cpus ? worker_buf : "any", numa_node,
+            numa_bind ? ", queues bound" : "");
+    return 0;
+}
+
+int affinity_apply_conn(void) {
+    if (!conn_pinned) {
+        return 0;
+    }
+
+    if (sched_setaffinity(0, sizeof(conn_set), &conn_set) != 0) {
+        ERROR_LOG("Pin conn process failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* The workers are assigned the CPUs round-robin. */
+int affinity_apply_worker(int index) {
+    cpu_set_t set;
+
+    if (!nworker_cpus) {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpus[index % nworker_cpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        ERROR_LOG("Pin worker %d to CPU %d failed: %s", index,
+                worker_cpus[index % nworker_cpus], strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_node(void) {
+    return numa_node;
+}
+
+int affinity_bind_memory(void *addr, size_t len) {
+    unsigned long mask;
+
+    if (!numa_bind || numa_node < 0 || nnodes < 2) {
+        return 0; /* nothing to gain on a single node */
+    }
+
+    mask = 1UL << numa_node;
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask,
+                sizeof(mask) * 8, MPOL_MF_MOVE) != 0) {
+        ERROR_LOG("mbind to node %d failed: %s", numa_node,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <math.h>
+#include "codel.h"
+
+void codel_init(codel_t *c, long long target, long long interval) {
+    c->target = target;
+    c->interval = interval;
+    c->first_above = 0;
+    c->drop_next = 0;
+    c->count = 0;
+    c->dropping = 0;
+}
+
+static long long control_law(codel_t *c, long long t) {
+    return t + (long long)(c->interval / sqrt(c->count));
+}
+
+/* Whether the delay has been above the target for an interval. */
+static int standing_delay(codel_t *c, long long sojourn, long long now) {
+    if (sojourn < c->target) {
+        c->first_above = 0;
+        return 0;
+    }
+    if (c->first_above == 0) {
+        c->first_above = now + c->interval;
+        return 0;
+    }
+    return now >= c->first_above;
+}
+
+int codel_should_drop(codel_t *c, long long sojourn, long long now) {
+    int above = standing_delay(c, sojourn, now);
+
+    if (c->dropping) {
+        if (!above) {
+            c->dropping = 0;
+            return 0;
+        }
+        if (now >= c->drop_next) {
+            ++c->count;
+            c->drop_next = control_law(c, c->drop_next);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (above) {
+        /* Resume near the last rate if the last dropping state ended 
+         * recently. */
+        c->dropping = 1;
+        if (c->count > 2 && now - c->drop_next < 8 * c->interval) {
+            c->count -= 2;
+        } else {
+            c->count = 1;
+        }
+        c->drop_next = control_law(c, now);
+        return 1;
+    }
+    return 0;
+}
+
+/* gcc codel.c -DCODEL_TEST_MAIN -I../inc -lm -g */
+#ifdef CODEL_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define TARGET      5000
+#define INTERVAL    100000
+#define STEP        100     /* between the requests */
+
+int main(int argc, char *argv[]) {
+    codel_t c;
+    long long now = 1000000, start, last = 0, gap, expect;
+    int drops = 0;
+
+    codel_init(&c, TARGET, INTERVAL);
+
+    /* Under the target, and above it for less than an interval */
+    for ( ; now < 1500000; now += STEP) {
+        assert(codel_should_drop(&c, TARGET - 1, now) == 0);
+    }
+    start = now;
+    for ( ; now < start + INTERVAL; now += STEP) {
+        assert(codel_should_drop(&c, TARGET * 2, now) == 0);
+    }
+    printf("no drop within an interval ok\n");
+
+    /* The first drop after a full interval, then interval/sqrt(count)
+     * apart */
+    for ( ; drops < 20; now += STEP) {
+        if (!codel_should_drop(&c, TARGET * 2, now)) {
+            continue;
+        }
+        if (drops == 0) {
+            assert(now == start + INTERVAL);
+        } else {
+            gap = now - last;
+            expect = (long long)(INTERVAL / sqrt(drops));
+            assert(gap >= expect - STEP && gap <= expect + STEP);
+        }
+        last = now;
+        ++drops;
+    }
+    assert(c.count == 20);
+    printf("drop rate ok\n");
+
+    /* Back under the target */
+    assert(codel_should_drop(&c, TARGET - 1, now) == 0);
+    assert(!c.dropping);
+    for (start = now; now < start + 10 * INTERVAL; now += STEP) {
+        assert(codel_should_drop(&c, TARGET - 1, now) == 0);
+    }
+    printf("stop under the target ok\n");
+    exit(0);
+}
+#endif /* CODEL_TEST_MAIN */
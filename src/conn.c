@@ -6,6 +6,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <signal.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include "verben.h"
 #include "daemon.h"
 #include "conn.h"
@@ -16,31 +19,139 @@
 #include "ae.h"
 #include "log.h"
 #include "conf.h"
-#include "vector.h"
 #include "notifier.h"
+#include "worker.h"
+#include "route.h"
+#include "framing.h"
+#include "group.h"
+#include "liveness.h"
+#include "fair.h"
 
 #define IOBUF_SIZE      4096
 #define MAX_PROT_LEN    4096
+#define MAX_EDGE_READS  16
+#define MAX_FLUSH_IOV   64
 
 static int      listen_fd;
 static char     sock_error[ANET_ERR_LEN];
 static dlist    *clients; 
 static int      client_limit;
 static int      client_timeout;
+static int      edge_triggered;
+static int      io_completion;  /* accept, recv and send by the loop */
+static int      write_cork;
+static int      ordered_responses;
+static int      max_inflight;
+static long long fast_budget;   /* microseconds of handle_fast per loop */
+static long long fast_spent;
+static int      fair_backlog;   /* requests queued to the workers at most */
+static client_conn **flush_list;
+static int      flush_num;
+static int      flush_size;
+static int      requests_queued; /* wake up the workers when flushing */
+static int      thread_mode;
+static int      loop_stats_interval;
+static time_t   loop_stats_time;
 static time_t   unix_clock;
 static pid_t    conn_pid;
-static vector_t *conn_vec;
-static client_conn *null = NULL;
+static unsigned int first_gen;  /* of the new slots */
 static ae_event_loop *ael;
+
+/* The connections by the slot of their ids. The free slots are reused 
+ * first, so the table is as dense as the connections open. A slot's 
+ * generation changes whenever it's freed, the stale ids don't match. */
+typedef struct conn_slot {
+    client_conn     *cli;
+    unsigned int    gen;
+    int             next_free;
+} conn_slot;
+
+static conn_slot *conn_slots;
+static int      nslots;
+static int      slots_size;
+static int      free_slot = -1;
 #ifdef DEBUG
 static unsigned int identifier = 0;
 #endif /* DEBUG */
 
+/* Give the connection an id of a free slot. Returns 0 on success, -1 
+ * if out of memory. */
+static int slot_alloc(client_conn *cli) {
+    conn_slot *s;
+    int i;
+
+    if (free_slot == -1) {
+        if (nslots == slots_size) {
+            int size = slots_size ? slots_size * 2 : 1024;
+            s = (conn_slot *)realloc(conn_slots, size * sizeof(conn_slot));
+            if (!s) {
+                return -1;
+            }
+            conn_slots = s;
+            slots_size = size;
+        }
+        conn_slots[nslots].gen = first_gen;
+        conn_slots[nslots].next_free = -1;
+        free_slot = nslots++;
+    }
+
+    i = free_slot;
+    s = &conn_slots[i];
+    free_slot = s->next_free;
+    s->cli = cli;
+    cli->id = ((unsigned long long)s->gen << 32) | (unsigned int)i;
+    liveness_set(cli->id);
+    return 0;
+}
+
+static void slot_free(client_conn *cli) {
+    conn_slot *s = &conn_slots[(unsigned int)cli->id];
+
+    liveness_clear(cli->id);
+    s->cli = NULL;
+    if (++s->gen == 0) {
+        ++s->gen; /* 0 is never a valid id */
+    }
+    s->next_free = free_slot;
+    free_slot = s - conn_slots;
+}
+
+/* The connection of the id, NULL if it has been closed. */
+static client_conn *lookup_client(unsigned long long id) {
+    unsigned int i = (unsigned int)id;
+
+    if (i >= (unsigned int)nslots || !conn_slots[i].cli 
+            || conn_slots[i].cli->id != id) {
+        return NULL;
+    }
+    return conn_slots[i].cli;
+}
+
+/* The message of a shared push is freed with its last recipient. */
+static void release_out(conn_out *out) {
+    if (!out->refs) {
+        free(out->msg);
+    } else if (--*out->refs == 0) {
+        free(out->msg);
+        free(out->refs);
+    }
+}
+
 static void free_client_node(void *cli) {
     client_conn *c = (client_conn *)cli;
+    int i;
+    for (i = 0; i < c->nout; ++i) {
+        release_out(&c->out[i]);
+    }
+    if (c->out) free(c->out);
+    for (i = 0; i < c->nheld; ++i) {
+        free(c->held[i].msg);
+    }
+    if (c->held) free(c->held);
     if (c->remote_ip) free(c->remote_ip);
     sdsfree(c->recvbuf);
     sdsfree(c->sendbuf);
+    sdsfree(c->sending);
     if (c) free(c);
 }
 
@@ -52,17 +163,70 @@ static void free_client(client_conn *cli) {
 }
 
 static void close_client(client_conn *cli) {
-    if (dll.handle_close) {
+    if (dll.handle_close_v2) {
+        dll.handle_close_v2(cli->ctx, cli->remote_ip, cli->remote_port);
+    } else if (dll.handle_close) {
         dll.handle_close(cli->remote_ip, cli->remote_port);
     }
-    ae_delete_file_event(ael, cli->fd, AE_READABLE);
-    ae_delete_file_event(ael, cli->fd, AE_WRITABLE);
-    assert(vector_set_at(conn_vec, cli->fd, (void *)&null) == 0);
+    group_leave_all(cli);
+    fair_detach(cli);
+    if (io_completion) {
+        /* The buffer in flight is freed by send_complete. */
+        ae_io_cancel(ael, cli->fd);
+        cli->sending = NULL;
+    } else {
+        ae_delete_file_event(ael, cli->fd, AE_READABLE);
+        ae_delete_file_event(ael, cli->fd, AE_WRITABLE);
+    }
+    slot_free(cli);
+    if (cli->flush_idx != -1) {
+        flush_list[cli->flush_idx] = NULL;
+    }
     close(cli->fd);
     cli->fd = -1;
     free_client(cli);
 }
 
+static void log_histogram(const char *name, ae_histogram *h) {
+    NOTICE_LOG("loop %s: count:%llu, avg:%lluus, p50:%lldus, p99:%lldus, "
+            "p999:%lldus, max:%lluus", name, h->count, 
+            h->count ? h->sum_us / h->count : 0,
+            ae_histogram_percentile(h, 50),
+            ae_histogram_percentile(h, 99),
+            ae_histogram_percentile(h, 99.9), h->max_us);
+}
+
+static void log_loop_stats(ae_event_loop *el) {
+    ae_loop_stats stats;
+    ae_timing timing;
+
+    if (el->busy_poll_us) {
+        ae_get_loop_stats(el, &stats, 1);
+        NOTICE_LOG("loop stats: iterations:%llu, spin polls:%llu, "
+                "spin hits:%llu, spin idle:%lluus, blocks:%llu",
+                stats.iterations, stats.spin_polls, stats.spin_hits,
+                stats.spin_idle_us, stats.blocks);
+    }
+
+    if (ae_get_timing(el, &timing, 1) == AE_OK) {
+        log_histogram("poll", &timing.poll);
+        log_histogram("file callbacks", &timing.file);
+        log_histogram("time callbacks", &timing.time);
+    }
+}
+
+static void slow_callback(ae_event_loop *el, int fd, void *proc,
+        const char *symbol, long long us) {
+    AE_NOTUSED(el);
+    if (fd == -1) {
+        WARNING_LOG("Slow time event callback %s(%p): %lldus", 
+                symbol ? symbol : "?", proc, us);
+    } else {
+        WARNING_LOG("Slow file event callback %s(%p) on fd %d: %lldus",
+                symbol ? symbol : "?", proc, fd, us);
+    }
+}
+
 static int server_cron(ae_event_loop *el, long long id, void *privdate) {
     dlist_iter iter;
     dlist_node *node;
@@ -80,56 +244,201 @@ static int server_cron(ae_event_loop *el, long long id, void *privdate) {
         }
     }
 
+    if (loop_stats_interval && 
+            unix_clock - loop_stats_time >= loop_stats_interval) {
+        log_loop_stats(el);
+        loop_stats_time = unix_clock;
+    }
+
     return 1000;
 }
 
-static void read_from_client(ae_event_loop *el, int fd, 
-        void *privdata, int mask) {
-    client_conn *cli = (client_conn *)privdata;
-    int nread;
-    char buf[IOBUF_SIZE];
-    AE_NOTUSED(el);
-    AE_NOTUSED(mask);
+static int deliver_response(client_conn *cli, shm_msg *msg, int len);
 
-    nread = read(fd, buf, IOBUF_SIZE);
-    cli->access_time = unix_clock;
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
-            return;
-        } else {
-            ERROR_LOG("%p:read connection %s:%d failed: %s",
-                    cli, cli->remote_ip, cli->remote_port, strerror(errno));
-            close_client(cli);
-            return;
-        }
-    } else if (nread == 0) {
-        NOTICE_LOG("%p:client close connection %s:%d", 
+static long long ustime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Try to answer the message at the head of `recvbuf' in the conn process
+ * with handle_fast. Returns 1 if it's answered, 0 if it should go to the
+ * workers, -1 if the connection has been closed. */
+static int process_fast(client_conn *cli) {
+    char *reply = NULL;
+    int reply_len = 0;
+    int ret;
+    long long start, elapsed;
+    shm_msg *msg;
+
+    if (fast_spent >= fast_budget) {
+        return 0; /* the rest of this iteration is left to the workers */
+    }
+    if (ordered_responses && cli->inflight > 0) {
+        return 0; /* it can't overtake the requests of the workers */
+    }
+
+    start = ustime();
+    ret = dll.handle_fast(cli->recvbuf, cli->recv_prot_len, &reply, 
+            &reply_len, cli->remote_ip, cli->remote_port);
+    elapsed = ustime() - start;
+    fast_spent += elapsed;
+    if (elapsed > fast_budget) {
+        WARNING_LOG("Slow handle_fast for connection %s:%d: %lldus",
+                cli->remote_ip, cli->remote_port, elapsed);
+    }
+
+    if (ret == VERBEN_DECLINED) {
+        return 0;
+    } else if (ret != VERBEN_OK && ret != VERBEN_CONN_CLOSE) {
+        close_client(cli);
+        return -1;
+    }
+
+    if (reply_len < 0 || (reply_len > 0 && !reply)) {
+        ERROR_LOG("%p:Invalid handle_fast response for connection %s:%d",
                 cli, cli->remote_ip, cli->remote_port);
         close_client(cli);
-        return;
+        return -1;
     }
-    buf[nread] = '\0';
 
-    cli->recvbuf = sdscatlen(cli->recvbuf, buf, nread);
+    msg = (shm_msg *)malloc(sizeof(*msg) + reply_len);
+    if (!msg) {
+        ERROR_LOG("%p:create response failed for connection %s:%d", 
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+        return -1;
+    }
+    msg->close_conn = (ret == VERBEN_CONN_CLOSE);
+    memcpy(msg->data, reply, reply_len);
+    if (deliver_response(cli, msg, sizeof(*msg) + reply_len) != 0) {
+        ERROR_LOG("%p:queue response failed for connection %s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+        return -1;
+    }
+    return 1;
+}
 
-    /* The plugin should definite the `handle_input` to process
-       the network protocol. */
-    if (cli->recv_prot_len == 0) { /* unknown protocol length */
-        cli->recv_prot_len = dll.handle_input(cli->recvbuf, 
-                sdslen(cli->recvbuf), cli->remote_ip, cli->remote_port);
+/* Put the request into the queue of the workers, they're woken up in 
+ * the flush phase. `msg' is freed, or taken over by the worker threads.
+ * Returns 0 on success, -1 on error. */
+static int queue_request(client_conn *cli, shm_msg *msg, int len) {
+    msg->enqueue_us = ustime();
+    if (thread_mode) {
+        if (worker_threads_push(msg, len) != 0) {
+            ERROR_LOG("%p:queue full for connection %s:%d", 
+                    cli, cli->remote_ip, cli->remote_port);
+            free(msg);
+            return -1;
+        }
+    } else {
+        if (route_push(cli, msg, len) != 0) {
+            ERROR_LOG("%p:shmq push failed for connection %s:%d", 
+                    cli, cli->remote_ip, cli->remote_port);
+            free(msg);
+            return -1;
+        }
+        free(msg);
     }
+    ++requests_queued;
+    return 0;
+}
+
+/* With 'fair_queue', pass the requests waiting in the conn process on 
+ * to the workers in their turns, keeping up to 'fair_backlog' queued to
+ * the workers. */
+static void fair_drain(void) {
+    client_conn *cli;
+    shm_msg *msg;
+    int len;
+    int room;
+
+    if (fair_policy() == FAIR_NONE) {
+        return;
+    }
+
+    room = fair_backlog - (thread_mode ? worker_threads_queued() 
+            : route_queued());
+    while (room-- > 0 && fair_dequeue(&cli, &msg, &len) == 0) {
+        if (queue_request(cli, msg, len) != 0) {
+            close_client(cli);
+        }
+    }
+}
+
+/* Cut the complete protocol datagrams off the receiving buffer and
+ * feed them to the worker processes. Returns -1 if the connection
+ * has been closed. */
+static int process_input(client_conn *cli) {
+    for ( ; ; ) {
+        /* The plugin should definite the `handle_input` to process
+           the network protocol, unless 'framing' is configured. */
+        if (cli->recv_prot_len == 0) { /* unknown protocol length */
+            if (sdslen(cli->recvbuf) == 0) {
+                return 0;
+            }
+            if (framing_type() != FRAMING_NONE) {
+                cli->recv_prot_len = framing_input(cli->recvbuf, 
+                        sdslen(cli->recvbuf), &cli->scanned, MAX_PROT_LEN);
+            } else if (dll.handle_input_v2) {
+                /* Only the bytes after `scanned' are new. */
+                cli->recv_prot_len = dll.handle_input_v2(cli->ctx, 
+                        cli->recvbuf, sdslen(cli->recvbuf), &cli->scanned,
+                        cli->remote_ip, cli->remote_port);
+            } else {
+                cli->recv_prot_len = dll.handle_input(cli->recvbuf, 
+                        sdslen(cli->recvbuf), cli->remote_ip, 
+                        cli->remote_port);
+            }
+        }
+
+        if (cli->recv_prot_len < 0 || cli->recv_prot_len > MAX_PROT_LEN) {
+            /* invalid protocol length */
+            ERROR_LOG("%p:Invalid protocol length:%d for connection %s:%d", 
+                    cli, cli->recv_prot_len, cli->remote_ip, 
+                    cli->remote_port);
+            close_client(cli);
+            return -1;
+        } else if (cli->recv_prot_len == 0) {
+            /* unknown protocol length */
+            /* process big protocol */
+            /* Do nothing, just continue to receive data. */
+            return 0;
+        } else if (sdslen(cli->recvbuf) < cli->recv_prot_len) {
+            return 0;
+        }
+
+        if (dll.handle_fast) {
+            int ret = process_fast(cli);
+            if (ret < 0) {
+                return -1;
+            } else if (ret > 0) {
+                cli->recvbuf = sdsrange(cli->recvbuf, cli->recv_prot_len, -1);
+                cli->recv_prot_len = 0;
+                cli->scanned = 0;
+                if (cli->close_conn) {
+                    return 0; /* nothing more is read */
+                }
+                continue;
+            }
+        }
+
+        /* Stop reading until the workers catch up, it bounds the 
+         * responses held for reordering. */
+        if (max_inflight && cli->inflight >= max_inflight) {
+            if (!cli->paused) {
+                /* No recv is in flight in completion mode, it's just
+                   not submitted again. */
+                if (!io_completion) {
+                    ae_delete_file_event(ael, cli->fd, AE_READABLE);
+                }
+                cli->paused = 1;
+            }
+            return 0;
+        }
 
-    if (cli->recv_prot_len < 0 || cli->recv_prot_len > MAX_PROT_LEN) {
-        /* invalid protocol length */
-        ERROR_LOG("%p:Invalid protocol length:%d for connection %s:%d", 
-                cli, cli->recv_prot_len, cli->remote_ip, cli->remote_port);
-        close_client(cli);
-    } else if (cli->recv_prot_len == 0) {
-        /* unknown protocol length */
-        /* process big protocol */
-        /* Do nothing, just continue to receive data. */
-    } else if (sdslen(cli->recvbuf) >= cli->recv_prot_len) {
         /* integrity protocol. We'll put the entire datagram into
          * shared memory queue to feed the worker processes. */
         shm_msg *msg = (shm_msg*)malloc(sizeof(*msg) + cli->recv_prot_len);
@@ -137,11 +446,13 @@ static void read_from_client(ae_event_loop *el, int fd,
             ERROR_LOG("%p:create message failed for connection %s:%d", 
                     cli, cli->remote_ip, cli->remote_port);
             close_client(cli);
-            return;
+            return -1;
         }
-        msg->cli = cli;
         msg->pid = conn_pid;
-        msg->fd = cli->fd;
+        msg->seq = cli->next_seq++;
+        msg->ctx = cli->ctx;
+        msg->conn_id = cli->id;
+        msg->type = SHM_MSG_RESPONSE;
 #ifdef DEBUG
         msg->identi = identifier++;
         msg->magic = CONN_MSG_MAGIC;
@@ -150,19 +461,111 @@ static void read_from_client(ae_event_loop *el, int fd,
         msg->remote_port = cli->remote_port;
         memcpy(msg->data, cli->recvbuf, cli->recv_prot_len);
 
-        if (shmq_push(recv_queue, msg, 
-                    sizeof(*msg) + cli->recv_prot_len, 0) != 0) {
-            ERROR_LOG("%p:shmq push failed for connection %s:%d", 
-                    cli, cli->remote_ip, cli->remote_port);
+        if (fair_policy() != FAIR_NONE) {
+            /* It waits for its turn, see fair_drain(). */
+            if (fair_enqueue(cli, msg, 
+                        sizeof(*msg) + cli->recv_prot_len) != 0) {
+                ERROR_LOG("%p:fair queue failed for connection %s:%d", 
+                        cli, cli->remote_ip, cli->remote_port);
+                free(msg);
+                close_client(cli);
+                return -1;
+            }
+        } else if (queue_request(cli, msg, 
+                    sizeof(*msg) + cli->recv_prot_len) != 0) {
             close_client(cli);
-            return;
+            return -1;
         }
-        free(msg);
+        ++cli->inflight;
         cli->recvbuf = sdsrange(cli->recvbuf, cli->recv_prot_len, -1);
         cli->recv_prot_len = 0;
+        cli->scanned = 0;
     }
 }
 
+static void read_from_client(ae_event_loop *el, int fd, 
+        void *privdata, int mask) {
+    client_conn *cli = (client_conn *)privdata;
+    int nread;
+    int loops = 0;
+    char buf[IOBUF_SIZE];
+    AE_NOTUSED(mask);
+
+    /* In edge-triggered mode, read until EAGAIN. The number of reads
+       is limited to keep other connections from starving, the rest
+       will be read in the next loop iteration. */
+    do {
+        nread = read(fd, buf, IOBUF_SIZE - 1);
+        cli->access_time = unix_clock;
+        if (nread == -1) {
+            if (errno == EAGAIN) {
+                ae_clear_ready(el, fd, AE_READABLE);
+                break;
+            } else {
+                ERROR_LOG("%p:read connection %s:%d failed: %s",
+                        cli, cli->remote_ip, cli->remote_port, 
+                        strerror(errno));
+                close_client(cli);
+                return;
+            }
+        } else if (nread == 0) {
+            NOTICE_LOG("%p:client close connection %s:%d", 
+                    cli, cli->remote_ip, cli->remote_port);
+            close_client(cli);
+            return;
+        }
+        buf[nread] = '\0';
+
+        cli->recvbuf = sdscatlen(cli->recvbuf, buf, nread);
+    } while (edge_triggered && ++loops < MAX_EDGE_READS);
+
+    process_input(cli);
+}
+
+static int start_reading(client_conn *cli);
+
+/* A recv of the completion layer, 'buf' is lent for this call. */
+static void recv_complete(ae_event_loop *el, int fd, void *privdata,
+        int res, char *buf) {
+    client_conn *cli = (client_conn *)privdata;
+    AE_NOTUSED(el);
+
+    if (fd == -1) {
+        return; /* cancelled, the client is gone */
+    }
+    cli->access_time = unix_clock;
+    if (res < 0) {
+        ERROR_LOG("%p:read connection %s:%d failed: %s",
+                cli, cli->remote_ip, cli->remote_port, strerror(-res));
+        close_client(cli);
+        return;
+    } else if (res == 0) {
+        NOTICE_LOG("%p:client close connection %s:%d", 
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+        return;
+    }
+
+    cli->recvbuf = sdscatlen(cli->recvbuf, buf, res);
+    if (process_input(cli) != 0 || cli->paused) {
+        return;
+    }
+    if (start_reading(cli) == AE_ERR) {
+        ERROR_LOG("%p:Submit recv failed for connection:%s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+    }
+}
+
+/* Wait for the requests, with a recv in completion mode. */
+static int start_reading(client_conn *cli) {
+    if (io_completion) {
+        return ae_io_recv(ael, cli->fd, recv_complete, cli);
+    }
+    return ae_create_file_event(ael, cli->fd, AE_READABLE,
+            read_from_client, cli);
+}
+
 static client_conn *create_client(int cli_fd, char *cli_ip, int cli_port) {
     client_conn *cli = (client_conn *)malloc(sizeof(*cli));
     if (!cli) {
@@ -170,17 +573,12 @@ static client_conn *create_client(int cli_fd, char *cli_ip, int cli_port) {
         return NULL;
     }
 
-    anet_nonblock(sock_error, cli_fd);
-    anet_tcp_nodelay(sock_error, cli_fd);
-
-    if (ae_create_file_event(ael, cli_fd, AE_READABLE,
-            read_from_client, cli) == AE_ERR) {
-        ERROR_LOG("%p:Create read file event failed for connection:%s:%d",
-                cli, cli_ip, cli_port);
-        close(cli_fd);
-        free(cli);
-        return NULL;
+    /* A blocking socket makes io_uring wait for the data instead of 
+       failing with EAGAIN. */
+    if (!io_completion) {
+        anet_nonblock(sock_error, cli_fd);
     }
+    anet_tcp_nodelay(sock_error, cli_fd);
 
 #ifdef DEBUG
     cli->magic = CONN_MAGIC_DEBUG;
@@ -190,20 +588,52 @@ static client_conn *create_client(int cli_fd, char *cli_ip, int cli_port) {
     cli->recv_prot_len = 0;
     cli->remote_ip = strdup(cli_ip);
     cli->remote_port = cli_port;
+    cli->ctx = NULL;
+    cli->scanned = 0;
     cli->recvbuf = sdsempty();
     cli->sendbuf = sdsempty();
+    cli->sending = NULL;
     cli->access_time = unix_clock ? unix_clock : time(NULL);
+    cli->inflight = 0;
+    cli->paused = 0;
+    cli->flush_idx = -1;
+    cli->nout = 0;
+    cli->out_size = 0;
+    cli->out = NULL;
+    cli->next_seq = 0;
+    cli->send_seq = 0;
+    cli->nheld = 0;
+    cli->held_size = 0;
+    cli->held = NULL;
+    cli->ngroups = 0;
+    cli->groups_size = 0;
+    cli->groups = NULL;
+    cli->flow = NULL;
     if (!dlist_add_node_tail(clients, cli)) {
         ERROR_LOG("%p:Add client connection %s:%d to list",
                 cli, cli->remote_ip, cli->remote_port);
-        ae_delete_file_event(ael, cli->fd, AE_READABLE);
         close(cli->fd);
         cli->fd = -1;
-        free(cli);
+        free_client_node(cli);
         return NULL;
     }
 
-    assert(vector_set_at(conn_vec, cli->fd, (void *)&cli) == 0);
+    if (slot_alloc(cli) != 0) {
+        ERROR_LOG("%p:Allocate the id of connection %s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close(cli_fd);
+        free_client(cli);
+        return NULL;
+    }
+
+    if (start_reading(cli) == AE_ERR) {
+        ERROR_LOG("%p:Create read file event failed for connection:%s:%d",
+                cli, cli_ip, cli_port);
+        slot_free(cli);
+        close(cli_fd);
+        free_client(cli);
+        return NULL;
+    }
     return cli;
 }
 
@@ -211,33 +641,100 @@ static void write_to_client(ae_event_loop *el, int fd,
         void *privdata, int mask) {
     client_conn *cli = (client_conn*)privdata;
     int nwrite;
-    AE_NOTUSED(el);
     AE_NOTUSED(mask);
 
-    nwrite = write(fd, cli->sendbuf, sdslen(cli->sendbuf));
-    cli->access_time = unix_clock;
-    if (nwrite < 0) {
-        if (errno == EAGAIN) {
-            nwrite = 0;
-        } else {
-            ERROR_LOG("%p:write to connection %s:%d failed:%s", 
-                    cli, cli->remote_ip, cli->remote_port);
-            close_client(cli);
+    do {
+        nwrite = write(fd, cli->sendbuf, sdslen(cli->sendbuf));
+        cli->access_time = unix_clock;
+        if (nwrite < 0) {
+            if (errno == EAGAIN) {
+                ae_clear_ready(el, fd, AE_WRITABLE);
+                return;
+            } else {
+                ERROR_LOG("%p:write to connection %s:%d failed:%s", 
+                        cli, cli->remote_ip, cli->remote_port,
+                        strerror(errno));
+                close_client(cli);
+                return;
+            }
+        }
+
+        if (nwrite == sdslen(cli->sendbuf)) {
+            /* In edge-triggered mode, it doesn't cost a syscall. */
+            ae_delete_file_event(el, cli->fd, AE_WRITABLE);
+            sdsclear(cli->sendbuf);
+            if (cli->close_conn) {
+                DEBUG_LOG("%p:Server close connection:%s:%d",
+                        cli, cli->remote_ip, cli->remote_port);
+                close_client(cli);
+            }
             return;
         }
+
+        /* process the left buffer */
+        cli->sendbuf = sdsrange(cli->sendbuf, nwrite, -1);
+    } while (edge_triggered);
+}
+
+static void send_complete(ae_event_loop *el, int fd, void *privdata,
+        int res, char *buf);
+
+/* Hand `sendbuf' over to a send of the completion layer, one is in 
+ * flight at most. Returns -1 if the connection has been closed. */
+static int send_client(client_conn *cli) {
+    cli->sending = cli->sendbuf;
+    cli->sendbuf = sdsempty();
+    if (ae_io_send(ael, cli->fd, cli->sending, sdslen(cli->sending),
+                send_complete, cli) == AE_ERR) {
+        ERROR_LOG("%p:Submit send failed for connection %s:%d", 
+                cli, cli->remote_ip, cli->remote_port);
+        sdsfree(cli->sending);
+        cli->sending = NULL;
+        close_client(cli);
+        return -1;
     }
+    return 0;
+}
 
-    if (nwrite == sdslen(cli->sendbuf)) {
-        ae_delete_file_event(el, cli->fd, AE_WRITABLE);
-        sdsclear(cli->sendbuf);
-        if (cli->close_conn) {
-            DEBUG_LOG("%d:Server close connection:%s:%d",
-                    cli, cli->remote_ip, cli->remote_port);
+static void send_complete(ae_event_loop *el, int fd, void *privdata,
+        int res, char *buf) {
+    client_conn *cli = (client_conn *)privdata;
+    AE_NOTUSED(el);
+
+    if (fd == -1) {
+        sdsfree(buf); /* cancelled, the client is gone */
+        return;
+    }
+    cli->access_time = unix_clock;
+    if (res < 0) {
+        ERROR_LOG("%p:write to connection %s:%d failed:%s", 
+                cli, cli->remote_ip, cli->remote_port, strerror(-res));
+        sdsfree(cli->sending);
+        cli->sending = NULL;
+        close_client(cli);
+        return;
+    }
+
+    if (res < sdslen(cli->sending)) {
+        /* process the left buffer */
+        cli->sending = sdsrange(cli->sending, res, -1);
+        if (ae_io_send(ael, fd, cli->sending, sdslen(cli->sending),
+                    send_complete, cli) == AE_ERR) {
+            sdsfree(cli->sending);
+            cli->sending = NULL;
             close_client(cli);
         }
-    } else {
-        /* process the left buffer */
-        cli->sendbuf = sdsrange(cli->sendbuf, nwrite, -1);
+        return;
+    }
+
+    sdsfree(cli->sending);
+    cli->sending = NULL;
+    if (sdslen(cli->sendbuf)) {
+        send_client(cli);
+    } else if (cli->close_conn) {
+        DEBUG_LOG("%p:Server close connection:%s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
     }
 }
 
@@ -259,8 +756,10 @@ static void accept_common_handler(int cli_fd, char *cli_ip, int cli_port) {
         return;
     }
 
-    if (dll.handle_open) {
-        int ret = dll.handle_open(&retbuf, &len, cli_ip, cli_port);
+    if (dll.handle_open || dll.handle_open_v2) {
+        int ret = dll.handle_open_v2 
+            ? dll.handle_open_v2(&c->ctx, &retbuf, &len, cli_ip, cli_port)
+            : dll.handle_open(&retbuf, &len, cli_ip, cli_port);
 
         if (ret == VERBEN_ERROR) {
             WARNING_LOG("%p:close connection %s:%d according to handle_open",
@@ -279,7 +778,9 @@ static void accept_common_handler(int cli_fd, char *cli_ip, int cli_port) {
 
             if (retbuf != NULL) {
                 c->sendbuf = sdscatlen(c->sendbuf, retbuf, len);
-                if (ae_create_file_event(ael, c->fd, AE_WRITABLE, 
+                if (io_completion) {
+                    send_client(c);
+                } else if (ae_create_file_event(ael, c->fd, AE_WRITABLE, 
                             write_to_client, c) == AE_ERR) {
                     ERROR_LOG("%p:create write file event failed on"
                             " connection %s:%d", 
@@ -295,40 +796,204 @@ static void accept_handler(ae_event_loop *el, int fd,
         void *privdata, int mask) {
     int cli_fd, cli_port;
     char cli_ip[16];
-    AE_NOTUSED(el);
     AE_NOTUSED(mask);
     AE_NOTUSED(privdata);
 
-    cli_fd = anet_tcp_accept(sock_error, fd, cli_ip, &cli_port);
-    if (cli_fd == ANET_ERR) {
+    do {
+        cli_fd = anet_tcp_accept(sock_error, fd, cli_ip, &cli_port);
+        if (cli_fd == ANET_ERR) {
+            if (errno == EAGAIN) {
+                ae_clear_ready(el, fd, AE_READABLE);
+            } else {
+                ERROR_LOG("Accept failed:%s", sock_error);
+            }
+            return;
+        }
+
+        DEBUG_LOG("Receive connection from %s:%d", cli_ip, cli_port);
+        accept_common_handler(cli_fd, cli_ip, cli_port);
+    } while (edge_triggered);
+}
+
+/* A connection accepted by the completion layer. */
+static void accept_complete(ae_event_loop *el, int fd, void *privdata,
+        int res, char *buf) {
+    int cli_port;
+    char cli_ip[16];
+    AE_NOTUSED(el);
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(buf);
+
+    if (fd == -1) {
+        if (res >= 0) {
+            close(res);
+        }
+        return;
+    }
+    if (res < 0) {
+        ERROR_LOG("Accept failed:%s", strerror(-res));
+        return;
+    }
+    if (anet_peer_tostring(sock_error, res, cli_ip, &cli_port) == ANET_ERR) {
         ERROR_LOG("Accept failed:%s", sock_error);
+        close(res);
         return;
     }
 
     DEBUG_LOG("Receive connection from %s:%d", cli_ip, cli_port);
-    accept_common_handler(cli_fd, cli_ip, cli_port);
+    accept_common_handler(res, cli_ip, cli_port);
 }
 
+static int process_responses(ae_event_loop *el);
+static int queue_response(client_conn *cli, shm_msg *msg, int len, 
+        int *refs);
+static int order_response(client_conn *cli, shm_msg *msg, int len);
+static int resume_client(client_conn *cli);
+
 static void notifier_handler(ae_event_loop *el, int fd,
         void *privdata, int mask) {
-    shm_msg *msg;
-    int len;
-    client_conn *cli;
-    client_conn **temp;
+    int n;
 
-    AE_NOTUSED(el);
     AE_NOTUSED(mask);
     AE_NOTUSED(privdata);
 
-    if (notifier_read() <= 0) {
+    for ( ; ; ) {
+        n = notifier_read();
+        if (n > 0) {
+            if (edge_triggered) {
+                continue; /* drain the pipe */
+            }
+            break;
+        } else if (n < 0 && errno == EAGAIN) {
+            ae_clear_ready(el, fd, AE_READABLE);
+            break;
+        }
         ERROR_LOG("notifier_read failed:%s", strerror(errno));
         return;
     }
 
-    /* Retrive all processed protocol datagram. */
-    while (shmq_pop(send_queue, (void**)&msg, &len, 0) == 0) {
+    process_responses(el);
+}
+
+/* Queue a push to the connections without copying it, the message is
+ * freed after it's written to the last of them. */
+static void push_shared(client_conn **members, int n, shm_msg *msg, 
+        int len) {
+    int *refs = (int *)malloc(sizeof(int));
+    int i;
+
+    if (!refs) {
+        ERROR_LOG("Out of memory for a push to %d connections", n);
+        free(msg);
+        return;
+    }
+
+    *refs = 1; /* held until all are queued */
+    for (i = 0; i < n; ++i) {
+        ++*refs;
+        if (queue_response(members[i], msg, len, refs) != 0) {
+            --*refs;
+            ERROR_LOG("%p:queue push failed for connection %s:%d",
+                    members[i], members[i]->remote_ip, 
+                    members[i]->remote_port);
+        }
+    }
+    if (--*refs == 0) {
+        free(msg);
+        free(refs);
+    }
+}
+
+/* A message sent by a worker with verben_push() and its kin. One
+ * message is fanned out to all the members of a group. */
+static void process_push(shm_msg *msg, int len) {
+    client_conn *cli;
+    client_conn **members;
+    char name[GROUP_NAME_MAX + 1];
+    dlist_iter iter;
+    dlist_node *node;
+    int n;
+
+    len -= sizeof(shm_msg);
+    switch (msg->type) {
+    case SHM_MSG_PUSH:
+        if (!(cli = lookup_client(msg->conn_id))) {
+            break; /* closed */
+        }
+        if (queue_response(cli, msg, len, NULL) != 0) {
+            ERROR_LOG("%p:queue push failed for connection %s:%d",
+                    cli, cli->remote_ip, cli->remote_port);
+            close_client(cli);
+            break;
+        }
+        return;
+    case SHM_MSG_JOIN:
+    case SHM_MSG_LEAVE:
+        if (!(cli = lookup_client(msg->conn_id))) {
+            break;
+        }
+        snprintf(name, sizeof(name), "%.*s", len, msg->data);
+        if (msg->type == SHM_MSG_LEAVE) {
+            group_leave(cli, name);
+        } else if (group_join(cli, name) != 0) {
+            ERROR_LOG("%p:join group %s failed for connection %s:%d",
+                    cli, name, cli->remote_ip, cli->remote_port);
+        }
+        break;
+    case SHM_MSG_GROUP:
+        n = strnlen(msg->data, len);
+        if (n == len || n > GROUP_NAME_MAX) {
+            ERROR_LOG("Invalid group push");
+            break;
+        }
+        memcpy(name, msg->data, n + 1);
+        members = group_members(name, &n);
+        if (!members) {
+            break;
+        }
+        /* Move the data to the head, where the recipients take it. */
+        len -= strlen(name) + 1;
+        memmove(msg->data, msg->data + strlen(name) + 1, len);
+        push_shared(members, n, msg, len);
+        return;
+    case SHM_MSG_BROADCAST:
+        if (!dlist_length(clients)) {
+            break;
+        }
+        members = (client_conn **)malloc(dlist_length(clients) * 
+                sizeof(client_conn *));
+        if (!members) {
+            ERROR_LOG("Out of memory for a broadcast");
+            break;
+        }
+        n = 0;
+        dlist_rewind(clients, &iter);
+        while ((node = dlist_next(&iter))) {
+            members[n++] = (client_conn *)dlist_node_value(node);
+        }
+        push_shared(members, n, msg, len);
+        free(members);
+        return;
+    default:
+        ERROR_LOG("Invalid message type %d", msg->type);
+        break;
+    }
+    free(msg);
+}
+
+/* Retrive all processed protocol datagram. Returns the number of 
+ * messages retrived. */
+static int process_responses(ae_event_loop *el) {
+    shm_msg *msg;
+    int len;
+    int processed = 0;
+    client_conn *cli;
+
+    while ((thread_mode ? worker_threads_pop(&msg, &len) 
+                : shmq_pop(send_queue, (void**)&msg, &len, 0)) == 0) {
+        ++processed;
 #ifdef DEBUG
-        /* check this to avoid core dump because of invalid cli address */
+        /* check this to catch a corrupted message early */
         if (msg->magic != CONN_MSG_MAGIC) {
             FATAL_LOG("Invalid message, magic number 0x%08x", 
                 msg->magic);
@@ -336,20 +1001,26 @@ static void notifier_handler(ae_event_loop *el, int fd,
             raise(SIGSEGV);
             continue;
         }
-        DEBUG_LOG("%p:identifier:%lu", msg->cli, msg->identi);
+        DEBUG_LOG("%llx:identifier:%lu", msg->conn_id, msg->identi);
 #endif /* DEBUG */
 
+        /* The pushes are checked by the generation of the ids. */
+        if (msg->type != SHM_MSG_RESPONSE) {
+            process_push(msg, len);
+            continue;
+        }
+
         if (conn_pid != msg->pid) {
             ERROR_LOG("pid[%d]'s datagram, discarded", msg->pid);
+            free(msg);
             continue;
         }
 
         /* It's a valid message. */
-        cli = msg->cli;
-        temp = vector_get_at(conn_vec, msg->fd);
-        if (!temp || *temp != cli) {
-            FATAL_LOG("%p:This fd has been closed, fd:%d, new vector value:%p", 
-                    cli, msg->fd, temp);
+        cli = lookup_client(msg->conn_id);
+        if (!cli) {
+            DEBUG_LOG("Connection %llx has been closed, response discarded",
+                    msg->conn_id);
             free(msg);
             continue;
         }
@@ -364,38 +1035,299 @@ static void notifier_handler(ae_event_loop *el, int fd,
         }
 #endif /* DEBUG */
 
-        if (msg->close_conn) {
-            cli->close_conn = 1;
+        if (cli->inflight > 0) {
+            --cli->inflight;
+        }
+
+        if (order_response(cli, msg, len) != 0) {
+            ERROR_LOG("%p:queue response failed for connection %s:%d",
+                    cli, cli->remote_ip, cli->remote_port);
+            close_client(cli);
+            continue;
+        }
+
+        if (cli->paused && cli->inflight < max_inflight) {
+            resume_client(cli);
+        }
+    }
+    return processed;
+}
+
+/* Hold the response until the flush phase, so that all the responses
+ * to the connection in this iteration are written at once. `msg' is 
+ * freed on error. */
+static int deliver_response(client_conn *cli, shm_msg *msg, int len) {
+    cli->close_conn = msg->close_conn ? 1 : 0;
+    if (queue_response(cli, msg, len - sizeof(shm_msg), NULL) != 0) {
+        free(msg);
+        return -1;
+    }
+    return 0;
+}
+
+/* With 'ordered_responses', the responses are sent in the order of the
+ * requests of the connection. Those answered early by another worker 
+ * are held until their turn. */
+static int order_response(client_conn *cli, shm_msg *msg, int len) {
+    int i;
+
+    if (!ordered_responses) {
+        return deliver_response(cli, msg, len);
+    }
+
+    if (msg->seq != cli->send_seq) {
+        if (cli->nheld == cli->held_size) {
+            int size = cli->held_size ? cli->held_size * 2 : 4;
+            conn_out *held = realloc(cli->held, size * sizeof(conn_out));
+            if (!held) {
+                free(msg);
+                return -1;
+            }
+            cli->held = held;
+            cli->held_size = size;
+        }
+        cli->held[cli->nheld].msg = msg;
+        cli->held[cli->nheld].len = len;
+        ++cli->nheld;
+        return 0;
+    }
+
+    if (deliver_response(cli, msg, len) != 0) {
+        return -1;
+    }
+    ++cli->send_seq;
+
+    /* Release the held responses that are next in turn. */
+    for (i = 0; i < cli->nheld; ) {
+        if (cli->held[i].msg->seq != cli->send_seq) {
+            ++i;
+            continue;
+        }
+        msg = cli->held[i].msg;
+        len = cli->held[i].len;
+        cli->held[i] = cli->held[--cli->nheld];
+        if (deliver_response(cli, msg, len) != 0) {
+            return -1;
+        }
+        ++cli->send_seq;
+        i = 0;
+    }
+    return 0;
+}
+
+/* The workers caught up, cut the requests buffered and read again. */
+static int resume_client(client_conn *cli) {
+    cli->paused = 0;
+    if (process_input(cli) != 0) {
+        return -1; /* closed */
+    }
+    if (cli->paused) {
+        return 0; /* still at the limit */
+    }
+
+    if (start_reading(cli) == AE_ERR) {
+        ERROR_LOG("%p:Create read file event failed for connection:%s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+        return -1;
+    }
+    return 0;
+}
+
+static int queue_response(client_conn *cli, shm_msg *msg, int len,
+        int *refs) {
+    if (cli->nout == cli->out_size) {
+        int size = cli->out_size ? cli->out_size * 2 : 4;
+        conn_out *out = realloc(cli->out, size * sizeof(conn_out));
+        if (!out) {
+            return -1;
+        }
+        cli->out = out;
+        cli->out_size = size;
+    }
+
+    if (cli->flush_idx == -1) {
+        if (flush_num == flush_size) {
+            int size = flush_size ? flush_size * 2 : 64;
+            client_conn **list = realloc(flush_list, 
+                    size * sizeof(client_conn *));
+            if (!list) {
+                return -1;
+            }
+            flush_list = list;
+            flush_size = size;
+        }
+        cli->flush_idx = flush_num;
+        flush_list[flush_num++] = cli;
+    }
+
+    cli->out[cli->nout].msg = msg;
+    cli->out[cli->nout].len = len;
+    cli->out[cli->nout].refs = refs;
+    ++cli->nout;
+    return 0;
+}
+
+/* Write the left buffer and the responses collected with a single 
+ * writev(2). The rest is kept in `sendbuf' for write_to_client. */
+static void flush_client(ae_event_loop *el, client_conn *cli) {
+    struct iovec iov[MAX_FLUSH_IOV];
+    struct msghdr mh;
+    int i, j, iovcnt = 0, first = 0;
+    ssize_t nwrite = 0;
+
+    /* The responses go out with a single send after the one in flight. */
+    if (io_completion) {
+        for (j = 0; j < cli->nout; ++j) {
+            cli->sendbuf = sdscatlen(cli->sendbuf, 
+                    cli->out[j].msg->data, cli->out[j].len);
+            release_out(&cli->out[j]);
+        }
+        cli->nout = 0;
+        if (cli->sending) {
+            return; /* see send_complete */
+        }
+        if (sdslen(cli->sendbuf)) {
+            send_client(cli);
+        } else if (cli->close_conn) {
+            DEBUG_LOG("%p:Server close connection:%s:%d",
+                    cli, cli->remote_ip, cli->remote_port);
+            close_client(cli);
+        }
+        return;
+    }
+
+    if (sdslen(cli->sendbuf) && 
+            (ae_get_file_events(el, cli->fd) & AE_WRITABLE)) {
+        /* The socket buffer is full, wait for write_to_client. */
+        nwrite = -1;
+        errno = EAGAIN;
+    } else {
+        if (sdslen(cli->sendbuf)) {
+            iov[iovcnt].iov_base = cli->sendbuf;
+            iov[iovcnt++].iov_len = sdslen(cli->sendbuf);
+            first = 1;
+        }
+        for (i = 0; i < cli->nout && iovcnt < MAX_FLUSH_IOV; ++i) {
+            iov[iovcnt].iov_base = cli->out[i].msg->data;
+            iov[iovcnt++].iov_len = cli->out[i].len;
+        }
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iovcnt;
+        /* Some queued responses didn't fit in, they're written right
+         * after, don't send a small packet in between. Responses still 
+         * in the workers aren't waited for, they may never come. */
+        nwrite = sendmsg(cli->fd, &mh, 
+                (write_cork && i < cli->nout) ? MSG_MORE : 0);
+        cli->access_time = unix_clock;
+    }
+
+    if (nwrite < 0) {
+        if (errno != EAGAIN) {
+            ERROR_LOG("%p:write to connection %s:%d failed:%s", 
+                    cli, cli->remote_ip, cli->remote_port, strerror(errno));
+            close_client(cli);
+            return;
+        }
+        nwrite = 0;
+    }
+
+    /* Keep the part not written. */
+    if (first) {
+        if (nwrite >= sdslen(cli->sendbuf)) {
+            nwrite -= sdslen(cli->sendbuf);
+            sdsclear(cli->sendbuf);
         } else {
-            cli->close_conn = 0;
+            cli->sendbuf = sdsrange(cli->sendbuf, nwrite, -1);
+            nwrite = 0;
         }
-        cli->sendbuf = sdscatlen(cli->sendbuf, msg->data, 
-                len - sizeof(shm_msg));
+    }
+    for (j = 0; j < cli->nout; ++j) {
+        if (nwrite >= cli->out[j].len) {
+            nwrite -= cli->out[j].len;
+        } else {
+            cli->sendbuf = sdscatlen(cli->sendbuf, 
+                    cli->out[j].msg->data + nwrite, 
+                    cli->out[j].len - nwrite);
+            nwrite = 0;
+        }
+        release_out(&cli->out[j]);
+    }
+    cli->nout = 0;
+
+    if (sdslen(cli->sendbuf)) {
         if (ae_create_file_event(el, cli->fd, AE_WRITABLE, 
                 write_to_client, cli) == AE_ERR) {
             close_client(cli);
         }
-        free(msg);
+    } else if (cli->close_conn) {
+        DEBUG_LOG("%p:Server close connection:%s:%d",
+                cli, cli->remote_ip, cli->remote_port);
+        close_client(cli);
+    }
+}
+
+/* The flush phase, before the event loop falls asleep. The workers are
+ * woken up once for all the requests queued in this iteration. */
+static void flush_clients(ae_event_loop *el) {
+    int i;
+    client_conn *cli;
+
+    fast_spent = 0;
+    fair_drain();
+    if (requests_queued) {
+        if (thread_mode) {
+            worker_threads_wake(requests_queued);
+        } else if (route_wake() < 0) {
+            ERROR_LOG("route_wake failed:%s", strerror(errno));
+        }
+        requests_queued = 0;
+    }
+
+    for (i = 0; i < flush_num; ++i) {
+        cli = flush_list[i];
+        if (!cli) {
+            continue; /* closed in this iteration */
+        }
+        cli->flush_idx = -1;
+        flush_client(el, cli);
     }
+    flush_num = 0;
+}
+
+/* In busy-polling mode, the send queue is checked in every spinning
+ * iteration, and the workers don't wake us up through the notifier. */
+static int conn_spin(ae_event_loop *el, int spinning) {
+    notifier_set_spinning(spinning);
+    return process_responses(el);
 }
 
 void conn_process_cycle(void *data) {
     char *host;
+    char *api;
     int port;
-    conf_t *conf = (conf_t*)data;
+    vb_cycle_t *cycle = (vb_cycle_t*)data;
+    conf_t *conf = &cycle->conf;
     int notifier = notifier_read_fd();
     vb_process = VB_PROCESS_CONN;
 
     conn_pid = getpid();
-    conn_vec = vector_new(10000, sizeof(client_conn *));
-    if (!conn_vec) {
-        boot_notify(-1, "Initialize clients connection vector"); 
+
+    /* A restarted conn process doesn't reuse the connection ids the 
+       workers may still hold. */
+    first_gen = ((unsigned int)time(NULL) << 8) | 1;
+    if (group_init() != 0) {
+        boot_notify(-1, "Initialize connection groups"); 
         kill(getppid(), SIGQUIT); /* exit the daemon */
         exit(0);
     }
 
     client_limit = conf_get_int_value(conf, "client_limit", 0);
     client_timeout = conf_get_int_value(conf, "client_timeout", 60);
+    thread_mode = !strcmp(conf_get_str_value(conf, "worker_mode", 
+                "process"), "thread");
 
     /* Initialize client connection linked list. */
     clients = dlist_init(); 
@@ -407,15 +1339,31 @@ void conn_process_cycle(void *data) {
         exit(0);
     }
 
-    ael = ae_create_event_loop();
+    /* Fall back to the default multiplexing layer when the one
+       configured is not supported. */
+    api = conf_get_str_value(conf, "event_api", NULL);
+    ael = ae_create_event_loop_api(api);
     if (!ael) {
         boot_notify(-1, "Initalize event loop structure.");
         kill(getppid(), SIGQUIT); /* exit the daemon */
         exit(0);
     }
 
+    if (api && strcmp(api, ae_get_api_name(ael))) {
+        boot_notify(-1, "Event loop on %s, fall back to %s", 
+                api, ae_get_api_name(ael));
+    }
+    io_completion = ae_io_supported(ael);
+
     DEBUG_LOG("ael pointer: %p", ael);
 
+    edge_triggered = conf_get_int_value(conf, "edge_triggered", 0);
+    if (ae_set_edge_triggered(ael, edge_triggered) == AE_ERR) {
+        boot_notify(-1, "Edge-triggered mode with %s", ae_get_api_name(ael));
+        kill(getppid(), SIGQUIT); /* exit the daemon */
+        exit(0);
+    }
+
     host = conf_get_str_value(conf, "server", "0.0.0.0");
     port = conf_get_int_value(conf, "port", 8773);
     listen_fd = anet_tcp_server(sock_error, host, port);
@@ -426,6 +1374,52 @@ void conn_process_cycle(void *data) {
         exit(0);
     }
 
+    /* Responses are written in the flush phase before sleeping. */
+    write_cork = conf_get_int_value(conf, "write_cork", 0);
+
+    /* Pipelined requests are answered in order, with up to 
+       'max_inflight' of them in the workers per connection. */
+    ordered_responses = conf_get_int_value(conf, "ordered_responses", 0);
+    max_inflight = conf_get_int_value(conf, "max_inflight", 128);
+
+    /* handle_fast runs for up to 'fast_budget' microseconds per loop 
+       iteration, so the other connections aren't stalled by it. */
+    fast_budget = conf_get_int_value(conf, "fast_budget", 1000);
+
+    /* With 'fair_queue', the requests wait for their turns in the conn
+       process while 'fair_backlog' are queued to the workers. */
+    if (fair_init(conf) != 0) {
+        boot_notify(-1, "Invalid fair_queue %s", 
+                conf_get_str_value(conf, "fair_queue", ""));
+        kill(getppid(), SIGQUIT); /* exit the daemon */
+        exit(0);
+    }
+    fair_backlog = conf_get_int_value(conf, "fair_backlog", 64);
+    ae_set_before_sleep_proc(ael, flush_clients);
+
+    /* Spin for up to 'busy_poll' microseconds after the last event
+       before falling asleep, it costs a core but saves the wakeups. */
+    ae_set_busy_poll(ael, conf_get_int_value(conf, "busy_poll", 0), 
+            conn_spin);
+    loop_stats_interval = conf_get_int_value(conf, "loop_stats_interval", 0);
+
+    /* Instrument the event loop to tell where the latency comes from. */
+    if (conf_get_int_value(conf, "loop_timing", 0) && ae_enable_timing(ael,
+                conf_get_int_value(conf, "slow_callback", 10000),
+                slow_callback) == AE_ERR) {
+        boot_notify(-1, "Enable event loop timing");
+        kill(getppid(), SIGQUIT); /* exit the daemon */
+        exit(0);
+    }
+    loop_stats_time = time(NULL);
+
+    /* Accept until EAGAIN in edge-triggered mode. */
+    if (edge_triggered && !io_completion && anet_nonblock(sock_error, listen_fd) == ANET_ERR) {
+        boot_notify(-1, "Set listen socket nonblocking: %s", sock_error);
+        kill(getppid(), SIGQUIT); /* exit the daemon */
+        exit(0);
+    }
+
     if (ae_create_time_event(ael, 1, server_cron, NULL, NULL) == AE_ERR) {
         boot_notify(-1, "Create time event");
         kill(getppid(), SIGQUIT); /* exit the daemon */
@@ -439,13 +1433,16 @@ void conn_process_cycle(void *data) {
         exit(0);
     }
 
-    if (listen_fd > 0 && ae_create_file_event(ael, listen_fd, 
-                AE_READABLE, accept_handler, NULL) == AE_ERR) {
+    if (listen_fd > 0 && (io_completion 
+                ? ae_io_accept(ael, listen_fd, accept_complete, NULL)
+                : ae_create_file_event(ael, listen_fd, AE_READABLE, 
+                    accept_handler, NULL)) == AE_ERR) {
         boot_notify(-1, "Create accept file event");
         kill(getppid(), SIGQUIT); /* exit the daemon */
         exit(0);
     }
 
+    cycle->el = ael;
     if (dll.handle_init) {
         if (dll.handle_init(data, vb_process) != VERBEN_OK) {
             boot_notify(-1, "Invoke handle_init hook in conn process");
@@ -454,15 +1451,27 @@ void conn_process_cycle(void *data) {
         }
     }
 
+    /* The worker threads start after handle_init, so the plugin can
+       set up the state they share. */
+    if (thread_mode && worker_threads_start(data) != 0) {
+        boot_notify(-1, "Start worker threads");
+        kill(getppid(), SIGQUIT); /* exit the daemon */
+        exit(0);
+    }
+
     redirect_std();
     ae_main(ael, &vb_quit);
 
+    if (thread_mode) {
+        worker_threads_stop();
+    }
+
     if (dll.handle_fini) {
         dll.handle_fini(data, vb_process);
     }
 
     ae_free_event_loop(ael);
     dlist_destroy(clients);
-    vector_free(conn_vec);
+    free(conn_slots);
     exit(0);
 }
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "coro.h"
+#include "anet.h"
+
+struct coro {
+    ucontext_t      ctx;
+    ucontext_t      caller;     /* where to go when it yields */
+    coro_proc       *proc;
+    void            *arg;
+    char            *stack;     /* with a guard page at the bottom */
+    size_t          stack_size;
+    int             done;
+    struct coro     *next;      /* in the pool */
+};
+
+/* A coroutine waiting for the event loop. */
+typedef struct coro_wait {
+    coro_t          *co;
+    int             mask;
+    long long       timer;
+} coro_wait;
+
+typedef struct coro_call {
+    coro_t          *co;
+    int             done;
+    int             status;
+    char            *resp;
+    int             len;
+} coro_call;
+
+static ae_event_loop *coro_el;
+static size_t   coro_stack_size = CORO_STACK_SIZE;
+static int      coro_max_pool = 64;
+static coro_t   *pool;
+static int      npool;
+static int      nactive;
+static coro_t   *current;
+static size_t   page_size;
+
+int coro_init(ae_event_loop *el, size_t stack_size, int max_pool) {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (stack_size < 4 * page_size) {
+        stack_size = 4 * page_size;
+    }
+    /* Round up to pages. */
+    coro_stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+    coro_max_pool = max_pool > 0 ? max_pool : 0;
+    coro_el = el;
+    return 0;
+}
+
+static void coro_main(void) {
+    coro_t *co = current;
+
+    co->proc(co->arg);
+    co->done = 1;
+    /* Never resumed again, the stack is recycled by coro_resume. */
+    swapcontext(&co->ctx, &co->caller);
+}
+
+static void coro_free(coro_t *co) {
+    munmap(co->stack, co->stack_size + page_size);
+    free(co);
+}
+
+coro_t *coro_create(coro_proc *proc, void *arg) {
+    coro_t *co;
+
+    if (!page_size) {
+        coro_init(coro_el, coro_stack_size, coro_max_pool);
+    }
+
+    if (pool) {
+        co = pool;
+        pool = co->next;
+        --npool;
+    } else {
+        co = (coro_t *)calloc(1, sizeof(*co));
+        if (!co) {
+            return NULL;
+        }
+        co->stack_size = coro_stack_size;
+        co->stack = mmap(NULL, co->stack_size + page_size,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (co->stack == MAP_FAILED) {
+            free(co);
+            return NULL;
+        }
+        /* Overflowing the stack faults rather than corrupting memory. */
+        mprotect(co->stack, page_size, PROT_NONE);
+    }
+
+    if (getcontext(&co->ctx) == -1) {
+        coro_free(co);
+        return NULL;
+    }
+    co->ctx.uc_stack.ss_sp = co->stack + page_size;
+    co->ctx.uc_stack.ss_size = co->stack_size;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, coro_main, 0);
+
+    co->proc = proc;
+    co->arg = arg;
+    co->done = 0;
+    co->next = NULL;
+    ++nactive;
+    return co;
+}
+
+int coro_resume(coro_t *co) {
+    coro_t *prev = current;
+
+    assert(!co->done);
+    current = co;
+    swapcontext(&co->caller, &co->ctx);
+    current = prev;
+
+    if (!co->done) {
+        return 0;
+    }
+
+    --nactive;
+    if (npool < coro_max_pool && co->stack_size == coro_stack_size) {
+        co->next = pool;
+        pool = co;
+        ++npool;
+    } else {
+        coro_free(co);
+    }
+    return 1;
+}
+
+void coro_yield(void) {
+    coro_t *co = current;
+
+    assert(co != NULL);
+    swapcontext(&co->ctx, &co->caller);
+}
+
+coro_t *coro_current(void) {
+    return current;
+}
+
+void *coro_arg(coro_t *co) {
+    return co->arg;
+}
+
+int coro_active(void) {
+    return nactive;
+}
+
+static void wait_file_proc(ae_event_loop *el, int fd, void *privdata,
+        int mask) {
+    coro_wait *w = (coro_wait *)privdata;
+    AE_NOTUSED(el);
+    AE_NOTUSED(fd);
+
+    w->mask = mask;
+    coro_resume(w->co);
+}
+
+static int wait_time_proc(ae_event_loop *el, long long id,
+        void *privdata) {
+    coro_wait *w = (coro_wait *)privdata;
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+
+    w->timer = AE_ERR; /* deleted by the event loop */
+    coro_resume(w->co);
+    return AE_NOMORE;
+}
+
+static int poll_fd(int fd, int mask, long long timeout) {
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (mask & AE_READABLE) pfd.events |= POLLIN;
+    if (mask & AE_WRITABLE) pfd.events |= POLLOUT;
+
+    do {
+        ret = poll(&pfd, 1, (int)timeout);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    ret = 0;
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) ret |= AE_READABLE;
+    if (pfd.revents & (POLLOUT | POLLERR | POLLHUP)) ret |= AE_WRITABLE;
+    return ret & mask;
+}
+
+int coro_wait_fd(int fd, int mask, long long timeout) {
+    coro_wait w;
+
+    if (!current || !coro_el) {
+        return poll_fd(fd, mask, timeout);
+    }
+
+    w.co = current;
+    w.mask = 0;
+    w.timer = AE_ERR;
+    if (ae_create_file_event(coro_el, fd, mask, wait_file_proc,
+                &w) == AE_ERR) {
+        return -1;
+    }
+    if (timeout >= 0) {
+        w.timer = ae_create_time_event(coro_el, timeout, wait_time_proc,
+                &w, NULL);
+    }
+
+    coro_yield();
+
+    ae_delete_file_event(coro_el, fd, mask);
+    if (w.timer != AE_ERR) {
+        ae_delete_time_event(coro_el, w.timer);
+    }
+    return w.mask;
+}
+
+void coro_sleep(long long ms) {
+    coro_wait w;
+
+    if (!current || !coro_el) {
+        usleep(ms * 1000);
+        return;
+    }
+
+    w.co = current;
+    w.mask = 0;
+    w.timer = ae_create_time_event(coro_el, ms, wait_time_proc, &w, NULL);
+    if (w.timer == AE_ERR) {
+        return;
+    }
+    coro_yield();
+}
+
+int coro_read(int fd, char *buf, int len, long long timeout) {
+    int nread;
+    int ready;
+
+    for ( ; ; ) {
+        nread = read(fd, buf, len);
+        if (nread >= 0) {
+            return nread;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN) {
+            return -1;
+        }
+
+        ready = coro_wait_fd(fd, AE_READABLE, timeout);
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (ready < 0) {
+            return -1;
+        }
+    }
+}
+
+int coro_write(int fd, const char *buf, int len, long long timeout) {
+    int nwritten;
+    int total = 0;
+    int ready;
+
+    while (total < len) {
+        nwritten = write(fd, buf + total, len - total);
+        if (nwritten >= 0) {
+            total += nwritten;
+            continue;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN) {
+            return -1;
+        }
+
+        ready = coro_wait_fd(fd, AE_WRITABLE, timeout);
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (ready < 0) {
+            return -1;
+        }
+    }
+    return total;
+}
+
+/* Returns a nonblocking connected socket, -1 on error. */
+int coro_connect(char *host, int port, long long timeout) {
+    int fd;
+    int ready;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    fd = anet_tcp_nonblock_connect(NULL, host, port);
+    if (fd == ANET_ERR) {
+        return -1;
+    }
+
+    ready = coro_wait_fd(fd, AE_WRITABLE, timeout);
+    if (ready <= 0) {
+        close(fd);
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+        }
+        return -1;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1
+            || err) {
+        close(fd);
+        if (err) {
+            errno = err;
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static void upstream_done(int status, const char *buf, int len,
+        void *privdata) {
+    coro_call *call = (coro_call *)privdata;
+
+    call->status = status;
+    if (status == UPSTREAM_OK) {
+        call->resp = (char *)malloc(len + 1);
+        if (call->resp) {
+            memcpy(call->resp, buf, len);
+            call->resp[len] = '\0';
+            call->len = len;
+        } else {
+            call->status = UPSTREAM_ERROR;
+        }
+    }
+    call->done = 1;
+    coro_resume(call->co);
+}
+
+int coro_upstream_request(upstream_t *up, const char *buf, int len,
+        char **resp, int *resp_len) {
+    coro_call call;
+
+    *resp = NULL;
+    *resp_len = 0;
+    if (!current) {
+        return UPSTREAM_ERROR;
+    }
+
+    call.co = current;
+    call.done = 0;
+    call.status = UPSTREAM_ERROR;
+    call.resp = NULL;
+    call.len = 0;
+    if (upstream_request(up, buf, len, upstream_done, &call) != 0) {
+        return UPSTREAM_ERROR;
+    }
+
+    /* The callback is never invoked before upstream_request returns. */
+    while (!call.done) {
+        coro_yield();
+    }
+
+    *resp = call.resp;
+    *resp_len = call.len;
+    return call.status;
+}
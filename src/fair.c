@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "fair.h"
+
+/* Besides its bytes, a request costs as much as 1KB of them, so the 
+ * small requests are counted by number and the large ones by size. */
+#define REQUEST_COST    1024
+
+/* A request waiting for its turn. */
+typedef struct fair_entry {
+    struct fair_entry   *next;
+    client_conn         *cli;
+    shm_msg             *msg;
+    int                 len;
+    int                 cost;
+} fair_entry;
+
+/* The queue of a connection, or of the connections from an IP. */
+typedef struct fair_flow {
+    char                *ip;        /* the key with FAIR_IP */
+    int                 refs;       /* connections sharing the flow */
+    int                 deficit;    /* the cost it may send in this turn */
+    int                 active;
+    struct fair_flow    *prev;      /* in the active list */
+    struct fair_flow    *next;
+    fair_entry          *head;
+    fair_entry          *tail;
+} fair_flow;
+
+static int          policy = FAIR_NONE;
+static int          quantum;
+static hash_t       *flows_by_ip;
+static fair_flow    *active_head;   /* the flows with requests queued */
+static fair_flow    *active_tail;
+
+static const char *policies[] = { "none", "conn", "ip", NULL };
+
+static void *key_dup(const void *key) {
+    return strdup((char *)key);
+}
+
+static int key_cmp(const void *key1, const void *key2) {
+    return strcmp((char *)key1, (char *)key2) == 0;
+}
+
+static void free_key(void *key) {
+    free(key);
+}
+
+int fair_init(conf_t *conf) {
+    char *name = conf_get_str_value(conf, "fair_queue", "none");
+
+    for (policy = 0; policies[policy]; ++policy) {
+        if (!strcmp(policies[policy], name)) {
+            break;
+        }
+    }
+    if (!policies[policy]) {
+        return -1;
+    }
+
+    quantum = conf_get_int_value(conf, "fair_quantum", 4096);
+    if (quantum < 1) {
+        return -1;
+    }
+
+    if (policy == FAIR_IP) {
+        flows_by_ip = hash_create(HASH_INIT_SLOTS);
+        if (!flows_by_ip) {
+            return -1;
+        }
+        HASH_SET_KEYCPY(flows_by_ip, key_dup);
+        HASH_SET_KEYCMP(flows_by_ip, key_cmp);
+        HASH_SET_FREE_KEY(flows_by_ip, free_key);
+    }
+    return 0;
+}
+
+int fair_policy(void) {
+    return policy;
+}
+
+static void activate(fair_flow *f) {
+    f->active = 1;
+    f->next = NULL;
+    f->prev = active_tail;
+    if (active_tail) {
+        active_tail->next = f;
+    } else {
+        active_head = f;
+    }
+    active_tail = f;
+}
+
+static void deactivate(fair_flow *f) {
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        active_head = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    } else {
+        active_tail = f->prev;
+    }
+    f->active = 0;
+    f->prev = f->next = NULL;
+}
+
+static fair_flow *attach(client_conn *cli) {
+    fair_flow *f = NULL;
+
+    if (policy == FAIR_IP) {
+        f = (fair_flow *)hash_get_val(flows_by_ip, cli->remote_ip);
+    }
+    if (!f) {
+        f = (fair_flow *)calloc(1, sizeof(fair_flow));
+        if (!f) {
+            return NULL;
+        }
+        if (policy == FAIR_IP) {
+            f->ip = strdup(cli->remote_ip);
+            if (!f->ip || hash_insert(flows_by_ip, f->ip, f) != 0) {
+                free(f->ip);
+                free(f);
+                return NULL;
+            }
+        }
+    }
+    ++f->refs;
+    cli->flow = f;
+    return f;
+}
+
+int fair_enqueue(client_conn *cli, shm_msg *msg, int len) {
+    fair_flow *f = cli->flow ? cli->flow : attach(cli);
+    fair_entry *e;
+
+    if (!f || !(e = (fair_entry *)malloc(sizeof(fair_entry)))) {
+        return -1;
+    }
+    e->next = NULL;
+    e->cli = cli;
+    e->msg = msg;
+    e->len = len;
+    e->cost = len - sizeof(shm_msg) + REQUEST_COST;
+
+    if (f->tail) {
+        f->tail->next = e;
+    } else {
+        f->head = e;
+    }
+    f->tail = e;
+
+    if (!f->active) {
+        f->deficit = 0; /* an idle flow doesn't save its deficit */
+        activate(f);
+    }
+    return 0;
+}
+
+/* Deficit round-robin: the flow at the head sends while its deficit
+ * covers the request, otherwise it's given a quantum more and waits for
+ * its next turn at the tail. */
+int fair_dequeue(client_conn **cli, shm_msg **msg, int *len) {
+    fair_flow *f;
+    fair_entry *e;
+
+    while ((f = active_head)) {
+        e = f->head;
+        if (e->cost > f->deficit) {
+            f->deficit += quantum;
+            if (f != active_tail) {
+                deactivate(f);
+                activate(f);
+            }
+            continue;
+        }
+
+        f->deficit -= e->cost;
+        f->head = e->next;
+        if (!f->head) {
+            f->tail = NULL;
+            deactivate(f);
+        }
+        *cli = e->cli;
+        *msg = e->msg;
+        *len = e->len;
+        free(e);
+        return 0;
+    }
+    return -1;
+}
+
+void fair_detach(client_conn *cli) {
+    fair_flow *f = cli->flow;
+    fair_entry **p, *e;
+
+    if (!f) {
+        return;
+    }
+    cli->flow = NULL;
+
+    /* Drop the requests of the connection, those of the other 
+     * connections of the flow keep their order. */
+    f->tail = NULL;
+    for (p = &f->head; (e = *p); ) {
+        if (e->cli == cli) {
+            *p = e->next;
+            free(e->msg);
+            free(e);
+        } else {
+            f->tail = e;
+            p = &e->next;
+        }
+    }
+    if (!f->head && f->active) {
+        deactivate(f);
+    }
+
+    if (--f->refs == 0) {
+        if (f->ip) {
+            hash_delete(flows_by_ip, f->ip);
+            free(f->ip);
+        }
+        free(f);
+    }
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include "framing.h"
+
+#define MAX_DELIMITER   16
+
+static int  type = FRAMING_NONE;
+
+/* FRAMING_LENGTH: the message is `offset + size + value + adjust' bytes,
+ * the `value' is the `size' bytes at `offset'. */
+static int  field_offset;
+static int  field_size;
+static int  big_endian;
+static int  adjust;
+
+/* FRAMING_DELIMITER */
+static char delimiter[MAX_DELIMITER];
+static int  delimiter_len;
+
+/* Decodes the escapes \r, \n, \t, \0, \\ and \xHH. */
+static int parse_delimiter(const char *s) {
+    char *end;
+    char hex[3] = {};
+
+    delimiter_len = 0;
+    while (*s) {
+        if (delimiter_len == MAX_DELIMITER) {
+            return -1;
+        }
+        if (*s != '\\') {
+            delimiter[delimiter_len++] = *s++;
+            continue;
+        }
+        switch (*++s) {
+        case 'r': delimiter[delimiter_len++] = '\r'; break;
+        case 'n': delimiter[delimiter_len++] = '\n'; break;
+        case 't': delimiter[delimiter_len++] = '\t'; break;
+        case '0': delimiter[delimiter_len++] = '\0'; break;
+        case '\\': delimiter[delimiter_len++] = '\\'; break;
+        case 'x':
+            if (!isxdigit(s[1]) || !isxdigit(s[2])) {
+                return -1;
+            }
+            hex[0] = s[1];
+            hex[1] = s[2];
+            delimiter[delimiter_len++] = (char)strtol(hex, &end, 16);
+            s += 2;
+            break;
+        default:
+            return -1;
+        }
+        ++s;
+    }
+    return delimiter_len ? 0 : -1;
+}
+
+static int parse_endian(const char *s) {
+    if (!strcmp(s, "big_endian")) {
+        big_endian = 1;
+    } else if (!strcmp(s, "little_endian")) {
+        big_endian = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* framing length_prefix <size> [big_endian|little_endian]
+ * framing length_field <offset> <size> <big_endian|little_endian> <adjust>
+ * framing delimiter <bytes> */
+int framing_init(conf_t *conf) {
+    char *value = conf_get_str_value(conf, "framing", NULL);
+    unsigned char *field[5];
+    char *buf;
+    int n, ret = -1;
+
+    if (!value || !strcmp(value, "none")) {
+        type = FRAMING_NONE;
+        return 0;
+    }
+
+    buf = strdup(value);
+    if (!buf) {
+        return -1;
+    }
+    n = str_explode(NULL, (unsigned char *)buf, field, 5);
+
+    if (!strcmp((char *)field[0], "length_prefix") && (n == 2 || n == 3)) {
+        type = FRAMING_LENGTH;
+        field_offset = 0;
+        field_size = atoi((char *)field[1]);
+        big_endian = 1;
+        adjust = 0;
+        ret = (n == 3) ? parse_endian((char *)field[2]) : 0;
+    } else if (!strcmp((char *)field[0], "length_field") && n == 5) {
+        type = FRAMING_LENGTH;
+        field_offset = atoi((char *)field[1]);
+        field_size = atoi((char *)field[2]);
+        adjust = atoi((char *)field[4]);
+        ret = parse_endian((char *)field[3]);
+        if (field_offset < 0) {
+            ret = -1;
+        }
+    } else if (!strcmp((char *)field[0], "delimiter") && n == 2) {
+        type = FRAMING_DELIMITER;
+        ret = parse_delimiter((char *)field[1]);
+    }
+
+    if (type == FRAMING_LENGTH && field_size != 1 && field_size != 2 
+            && field_size != 4 && field_size != 8) {
+        ret = -1;
+    }
+    free(buf);
+    return ret;
+}
+
+int framing_type(void) {
+    return type;
+}
+
+static int length_input(const unsigned char *buf, int len) {
+    unsigned long long value = 0;
+    long long total;
+    int i;
+
+    if (len < field_offset + field_size) {
+        return 0;
+    }
+
+    buf += field_offset;
+    for (i = 0; i < field_size; ++i) {
+        if (big_endian) {
+            value = (value << 8) | buf[i];
+        } else {
+            value |= (unsigned long long)buf[i] << (8 * i);
+        }
+    }
+    if (value > INT_MAX) {
+        return -1;
+    }
+
+    total = (long long)field_offset + field_size + (long long)value + adjust;
+    if (total <= 0 || total > INT_MAX) {
+        return -1;
+    }
+    return (int)total;
+}
+
+/* Looks for the last byte of the delimiter, memchr is vectorized by the
+ * libc. A match can't end before `*scanned', so the bytes are searched
+ * once. */
+static int delimiter_input(const char *buf, int len, int *scanned, 
+        int max) {
+    const char *p = buf + *scanned;
+    const char *end = buf + len;
+    char last = delimiter[delimiter_len - 1];
+
+    while (p < end && (p = memchr(p, last, end - p))) {
+        if (p - buf >= delimiter_len - 1 && !memcmp(p - delimiter_len + 1,
+                    delimiter, delimiter_len - 1)) {
+            return p + 1 - buf;
+        }
+        ++p;
+    }
+
+    *scanned = len;
+    return len >= max ? -1 : 0;
+}
+
+int framing_input(const char *buf, int len, int *scanned, int max) {
+    switch (type) {
+    case FRAMING_LENGTH:
+        return length_input((const unsigned char *)buf, len);
+    case FRAMING_DELIMITER:
+        return delimiter_input(buf, len, scanned, max);
+    }
+    return -1;
+}
+
+/* gcc framing.c conf.c hash.c -DFRAMING_TEST_MAIN -I../inc -g */
+#ifdef FRAMING_TEST_MAIN
+#include <assert.h>
+
+static void set_length(int offset, int size, int big, int adj) {
+    type = FRAMING_LENGTH;
+    field_offset = offset;
+    field_size = size;
+    big_endian = big;
+    adjust = adj;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned char msg[32] = {};
+    char stream[64];
+    int scanned = 0;
+
+    /* The escapes of the delimiter */
+    assert(parse_delimiter("\\r\\n") == 0 && delimiter_len == 2 
+            && !memcmp(delimiter, "\r\n", 2));
+    assert(parse_delimiter("a\\0\\t\\\\") == 0 && delimiter_len == 4
+            && !memcmp(delimiter, "a\0\t\\", 4));
+    assert(parse_delimiter("\\x7f\\x0A") == 0 && delimiter_len == 2
+            && delimiter[0] == 0x7f && delimiter[1] == '\n');
+    assert(parse_delimiter("\\x7") == -1);
+    assert(parse_delimiter("\\xzz") == -1);
+    assert(parse_delimiter("\\q") == -1);
+    assert(parse_delimiter("") == -1);
+    assert(parse_delimiter("0123456789abcdef") == 0 
+            && delimiter_len == MAX_DELIMITER);
+    assert(parse_delimiter("0123456789abcdefg") == -1);
+    printf("parse_delimiter ok\n");
+
+    /* A 2-byte big endian prefix, incomplete until the field is in */
+    set_length(0, 2, 1, 0);
+    msg[0] = 0x01;
+    msg[1] = 0x02;
+    assert(length_input(msg, 1) == 0);
+    assert(length_input(msg, 2) == 2 + 0x0102);
+
+    /* Little endian, fields of 1, 4 and 8 bytes */
+    set_length(0, 2, 0, 0);
+    assert(length_input(msg, 2) == 2 + 0x0201);
+    set_length(0, 1, 1, 0);
+    assert(length_input(msg, 1) == 1 + 0x01);
+    memset(msg, 0, sizeof(msg));
+    msg[0] = 0x10;
+    set_length(0, 4, 0, 0);
+    assert(length_input(msg, 4) == 4 + 0x10);
+    set_length(0, 4, 1, 0);
+    assert(length_input(msg, 4) == 4 + 0x10000000);
+    set_length(0, 8, 0, 0);
+    assert(length_input(msg, 8) == 8 + 0x10);
+
+    /* A field after a header, its value counting the whole message */
+    memset(msg, 0, sizeof(msg));
+    msg[3] = 20;
+    set_length(2, 2, 1, -4);
+    assert(length_input(msg, 3) == 0);
+    assert(length_input(msg, 4) == 20);
+    set_length(2, 2, 1, -30);
+    assert(length_input(msg, 4) == -1);
+
+    /* Values past INT_MAX are refused, with the header added too */
+    memset(msg, 0xff, 8);
+    set_length(0, 8, 1, 0);
+    assert(length_input(msg, 8) == -1);
+    memset(msg, 0, 8);
+    msg[0] = 0x7f;
+    msg[1] = msg[2] = msg[3] = 0xff;
+    set_length(0, 4, 1, 0);
+    assert(length_input(msg, 4) == -1);
+    set_length(0, 4, 1, -4);
+    assert(length_input(msg, 4) == INT_MAX);
+    printf("length_input ok\n");
+
+    /* A delimiter split across the reads */
+    parse_delimiter("\\r\\n\\r\\n");
+    strcpy(stream, "GET / HTTP/1.0\r\n\r");
+    assert(delimiter_input(stream, 17, &scanned, 64) == 0);
+    assert(scanned == 17);
+    strcat(stream, "\nnext");
+    assert(delimiter_input(stream, 22, &scanned, 64) == 18);
+
+    /* A match before the bytes scanned isn't seen again */
+    scanned = 0;
+    assert(delimiter_input("\r\n\r\n", 4, &scanned, 64) == 4);
+
+    /* No delimiter in `max' bytes */
+    scanned = 0;
+    memset(stream, 'a', sizeof(stream));
+    assert(delimiter_input(stream, 63, &scanned, 64) == 0);
+    assert(delimiter_input(stream, 64, &scanned, 64) == -1);
+    printf("delimiter_input ok\n");
+
+    exit(0);
+}
+#endif /* FRAMING_TEST_MAIN */
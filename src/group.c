@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+#include "group.h"
+
+typedef struct conn_group {
+    char        *name;
+    client_conn **members;
+    int         nmembers;
+    int         size;
+} conn_group;
+
+/* A group joined by a connection, and the position of the connection in
+ * its members, so a connection leaves in O(1). */
+typedef struct group_ref {
+    conn_group  *group;
+    int         index;
+} group_ref;
+
+static hash_t *groups;
+
+static void *key_dup(const void *key) {
+    return strdup((char *)key);
+}
+
+static int key_cmp(const void *key1, const void *key2) {
+    return strcmp((char *)key1, (char *)key2) == 0;
+}
+
+static void free_key(void *key) {
+    free(key);
+}
+
+int group_init(void) {
+    groups = hash_create(HASH_INIT_SLOTS);
+    if (!groups) {
+        return -1;
+    }
+    HASH_SET_KEYCPY(groups, key_dup);
+    HASH_SET_KEYCMP(groups, key_cmp);
+    HASH_SET_FREE_KEY(groups, free_key);
+    return 0;
+}
+
+static int find_ref(client_conn *cli, conn_group *g) {
+    int i;
+
+    for (i = 0; i < cli->ngroups; ++i) {
+        if (cli->groups[i].group == g) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void drop(conn_group *g) {
+    hash_delete(groups, g->name);
+    free(g->name);
+    free(g->members);
+    free(g);
+}
+
+int group_join(client_conn *cli, const char *name) {
+    conn_group *g = (conn_group *)hash_get_val(groups, name);
+    group_ref *refs;
+    client_conn **members;
+    int size;
+
+    if (g && find_ref(cli, g) >= 0) {
+        return 0;
+    }
+
+    if (cli->ngroups == cli->groups_size) {
+        size = cli->groups_size ? cli->groups_size * 2 : 4;
+        refs = (group_ref *)realloc(cli->groups, size * sizeof(group_ref));
+        if (!refs) {
+            return -1;
+        }
+        cli->groups = refs;
+        cli->groups_size = size;
+    }
+
+    if (!g) {
+        g = (conn_group *)calloc(1, sizeof(conn_group));
+        if (!g) {
+            return -1;
+        }
+        g->name = strdup(name);
+        if (!g->name || hash_insert(groups, name, g) != 0) {
+            free(g->name);
+            free(g);
+            return -1;
+        }
+    }
+
+    if (g->nmembers == g->size) {
+        size = g->size ? g->size * 2 : 16;
+        members = (client_conn **)realloc(g->members, 
+                size * sizeof(client_conn *));
+        if (!members) {
+            if (g->nmembers == 0) {
+                drop(g);
+            }
+            return -1;
+        }
+        g->members = members;
+        g->size = size;
+    }
+
+    cli->groups[cli->ngroups].group = g;
+    cli->groups[cli->ngroups].index = g->nmembers;
+    ++cli->ngroups;
+    g->members[g->nmembers++] = cli;
+    return 0;
+}
+
+/* Move the last member into the hole, and drop the group once it's
+ * empty. */
+static void leave(client_conn *cli, int i) {
+    conn_group *g = cli->groups[i].group;
+    int index = cli->groups[i].index;
+    client_conn *last = g->members[--g->nmembers];
+
+    if (last != cli) {
+        g->members[index] = last;
+        last->groups[find_ref(last, g)].index = index;
+    }
+    cli->groups[i] = cli->groups[--cli->ngroups];
+
+    if (g->nmembers == 0) {
+        drop(g);
+    }
+}
+
+int group_leave(client_conn *cli, const char *name) {
+    conn_group *g = (conn_group *)hash_get_val(groups, name);
+    int i;
+
+    if (!g || (i = find_ref(cli, g)) < 0) {
+        return -1;
+    }
+    leave(cli, i);
+    return 0;
+}
+
+void group_leave_all(client_conn *cli) {
+    while (cli->ngroups) {
+        leave(cli, cli->ngroups - 1);
+    }
+    free(cli->groups);
+    cli->groups = NULL;
+    cli->groups_size = 0;
+}
+
+client_conn **group_members(const char *name, int *n) {
+    conn_group *g = (conn_group *)hash_get_val(groups, name);
+
+    if (!g) {
+        *n = 0;
+        return NULL;
+    }
+    *n = g->nmembers;
+    return g->members;
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include "liveness.h"
+
+#define DEFAULT_SLOTS   65536
+
+/* The id of the connection in each slot, 0 if it's free. */
+static volatile unsigned long long *live = MAP_FAILED;
+static unsigned int nslots;
+
+int liveness_init(conf_t *conf) {
+    int limit = conf_get_int_value(conf, "client_limit", 0);
+
+    /* One more, the connection over the limit is closed after it's 
+     * accepted. */
+    nslots = limit > 0 ? limit + 1 : DEFAULT_SLOTS;
+    live = mmap(NULL, nslots * sizeof(*live), PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return live == MAP_FAILED ? -1 : 0;
+}
+
+void liveness_set(unsigned long long id) {
+    if ((unsigned int)id < nslots) {
+        live[(unsigned int)id] = id;
+    }
+}
+
+void liveness_clear(unsigned long long id) {
+    if ((unsigned int)id < nslots) {
+        live[(unsigned int)id] = 0;
+    }
+}
+
+int liveness_check(unsigned long long id) {
+    if ((unsigned int)id >= nslots) {
+        return 1;
+    }
+    return live[(unsigned int)id] == id;
+}
@@ -103,7 +103,10 @@ int sysv_sem_lock(int semid) {
     op.sem_op = -1;
     op.sem_flg = SEM_UNDO;
 
-    rc = semop(semid, &op, 1);
+    /* A signal caught while waiting isn't a failure to lock. */
+    do {
+        rc = semop(semid, &op, 1);
+    } while (rc < 0 && errno == EINTR);
     return rc;
 }
 
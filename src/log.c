@@ -8,6 +8,7 @@
 #include <time.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include "log.h"
@@ -38,7 +39,10 @@ static char *log_level_text[] = {
     "DEBUG  " 
 };
 
-static char *log_buffer = MAP_FAILED;
+static __thread char *log_buffer = MAP_FAILED; /* per worker thread */
+/* The worker threads share the log files, the lock keeps one thread
+   from closing or rotating a fd another one is writing to. */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 static int log_has_init;
 static int log_level;
 static int log_size;
@@ -165,6 +169,7 @@ void boot_notify(int ok, const char *fmt, ...) {
 
 void log_close() {
     int i;
+    pthread_mutex_lock(&log_lock);
     if (log_multi) {
         for (i = 0; i <= LOG_LEVEL_DEBUG; ++i) {
             if (log_files[i].fd != -1) {
@@ -177,6 +182,7 @@ void log_close() {
         log_files[0].fd = -1;
     }
     log_has_init = 0;
+    pthread_mutex_unlock(&log_lock);
 }
 
 void log_write(int level, const char *fmt, ...) {
@@ -217,6 +223,7 @@ void log_write(int level, const char *fmt, ...) {
 
     index = log_multi ? level : 0;
 
+    pthread_mutex_lock(&log_lock);
     if ((log_files[index].fd != -1 && 
             log_rotate(log_files[index].fd, 
                 (const char*)log_files[index].path) == 0)) {
@@ -230,6 +237,7 @@ void log_write(int level, const char *fmt, ...) {
         if (log_files[index].fd < 0) {
             fprintf(stderr, "open log file %s failed: %s\n", 
                 log_files[index].path, strerror(errno));
+            pthread_mutex_unlock(&log_lock);
             return;
         }
 
@@ -242,8 +250,8 @@ void log_write(int level, const char *fmt, ...) {
             != end + pos + 1) {
         fprintf(stderr, "write log to file %s failed: %s\n", 
             log_files[index].path, strerror(errno));
-        return;
     }
+    pthread_mutex_unlock(&log_lock);
 }
 
 #ifdef TEST_LOG_MAIN
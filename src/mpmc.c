@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include "mpmc.h"
+
+#define CACHE_LINE  64
+
+/* A cell is writable by the producer when its sequence equals the
+ * position, and readable by the consumer when it equals position + 1.
+ * See Dmitry Vyukov's bounded MPMC queue. */
+typedef struct mpmc_cell {
+    volatile unsigned long  seq;
+    void                    *data;
+    int                     len;
+} mpmc_cell;
+
+struct mpmc {
+    mpmc_cell               *cells;
+    unsigned long           mask;
+    char                    pad0[CACHE_LINE];
+    volatile unsigned long  enqueue_pos;
+    char                    pad1[CACHE_LINE];
+    volatile unsigned long  dequeue_pos;
+    char                    pad2[CACHE_LINE];
+};
+
+mpmc_t *mpmc_create(unsigned int size) {
+    mpmc_t *q;
+    unsigned long n = 2;
+    unsigned long i;
+
+    while (n < size) {
+        n <<= 1;
+    }
+
+    q = (mpmc_t *)calloc(1, sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+
+    q->cells = (mpmc_cell *)malloc(sizeof(mpmc_cell) * n);
+    if (!q->cells) {
+        free(q);
+        return NULL;
+    }
+
+    for (i = 0; i < n; ++i) {
+        q->cells[i].seq = i;
+    }
+    q->mask = n - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    return q;
+}
+
+void mpmc_free(mpmc_t *q) {
+    free(q->cells);
+    free(q);
+}
+
+int mpmc_push(mpmc_t *q, void *data, int len) {
+    mpmc_cell *cell;
+    unsigned long pos = q->enqueue_pos;
+    long diff;
+
+    for ( ; ; ) {
+        cell = &q->cells[pos & q->mask];
+        diff = (long)cell->seq - (long)pos;
+        __sync_synchronize();
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&q->enqueue_pos, 
+                        pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; /* full */
+        }
+        pos = q->enqueue_pos;
+    }
+
+    cell->data = data;
+    cell->len = len;
+    __sync_synchronize();
+    cell->seq = pos + 1;
+    return 0;
+}
+
+int mpmc_pop(mpmc_t *q, void **data, int *len) {
+    mpmc_cell *cell;
+    unsigned long pos = q->dequeue_pos;
+    long diff;
+
+    for ( ; ; ) {
+        cell = &q->cells[pos & q->mask];
+        diff = (long)cell->seq - (long)(pos + 1);
+        __sync_synchronize();
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&q->dequeue_pos, 
+                        pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; /* empty */
+        }
+        pos = q->dequeue_pos;
+    }
+
+    *data = cell->data;
+    *len = cell->len;
+    __sync_synchronize();
+    cell->seq = pos + q->mask + 1;
+    return 0;
+}
+
+/* gcc mpmc.c -DMPMC_TEST_MAIN -I../inc -lpthread -g */
+#ifdef MPMC_TEST_MAIN
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define PRODUCERS   4
+#define CONSUMERS   4
+#define COUNT       1000000
+
+static mpmc_t *queue;
+static unsigned char *seen;
+static volatile long consumed;
+
+static void *producer(void *arg) {
+    long base = (long)arg * COUNT;
+    long i;
+
+    for (i = 0; i < COUNT; ++i) {
+        while (mpmc_push(queue, (void *)(base + i), (int)(base + i)) != 0) {
+            sched_yield(); /* full */
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    void *data;
+    int len;
+
+    while (consumed < (long)PRODUCERS * COUNT) {
+        if (mpmc_pop(queue, &data, &len) != 0) {
+            sched_yield(); /* empty */
+            continue;
+        }
+        assert((long)data == len);
+        assert(__sync_fetch_and_add(&seen[len], 1) == 0);
+        __sync_fetch_and_add(&consumed, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t threads[PRODUCERS + CONSUMERS];
+    void *data;
+    long i;
+    int len;
+
+    /* Rounded up to 8 cells, FIFO in a single thread */
+    queue = mpmc_create(5);
+    assert(mpmc_pop(queue, &data, &len) == -1);
+    for (i = 0; i < 8; ++i) {
+        assert(mpmc_push(queue, (void *)i, (int)i) == 0);
+    }
+    assert(mpmc_push(queue, (void *)i, (int)i) == -1);
+    for (i = 0; i < 8; ++i) {
+        assert(mpmc_pop(queue, &data, &len) == 0);
+        assert((long)data == i && len == i);
+    }
+    assert(mpmc_pop(queue, &data, &len) == -1);
+    mpmc_free(queue);
+    printf("full and empty ok\n");
+
+    /* Every item arrives once, the producers often find it full */
+    queue = mpmc_create(64);
+    seen = calloc((long)PRODUCERS * COUNT, 1);
+    for (i = 0; i < CONSUMERS; ++i) {
+        pthread_create(&threads[i], NULL, consumer, NULL);
+    }
+    for (i = 0; i < PRODUCERS; ++i) {
+        pthread_create(&threads[CONSUMERS + i], NULL, producer, (void *)i);
+    }
+    for (i = 0; i < PRODUCERS + CONSUMERS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < (long)PRODUCERS * COUNT; ++i) {
+        assert(seen[i] == 1);
+    }
+    assert(mpmc_pop(queue, &data, &len) == -1);
+    free(seen);
+    mpmc_free(queue);
+    printf("%d producers, %d consumers: %ld items ok\n", 
+            PRODUCERS, CONSUMERS, (long)PRODUCERS * COUNT);
+    exit(0);
+}
+#endif /* MPMC_TEST_MAIN */
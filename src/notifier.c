@@ -5,11 +5,15 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "notifier.h"
 #include "log.h"
 
 static char buffer[1024];
 static int pipe_fds[2];
+/* Shared with the workers. When the reader is spinning on the queue,
+ * the writers needn't wake it up through the pipe. */
+static volatile int *spinning = MAP_FAILED;
 
 static int fd_nonblock(int fd) {
     int flags;
@@ -35,9 +39,28 @@ int notifier_create() {
     assert(fd_nonblock(pipe_fds[1]) == 0);
     fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
     fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+    spinning = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (spinning == MAP_FAILED) {
+        fprintf(stderr, "%s\n", strerror(errno));
+        return -1;
+    }
+    *spinning = 0;
     return 0;
 }
 
+/* Called by the reader. Once it stops spinning, it MUST check the queue
+ * again before sleeping: the barriers pair with the one in 
+ * notifier_write() so that either the writer sees the reader sleeping
+ * or the reader sees the data pushed by the writer. */
+void notifier_set_spinning(int on) {
+    if (*spinning != on) {
+        *spinning = on;
+    }
+    __sync_synchronize();
+}
+
 void notifier_close_wr() {
     close(pipe_fds[1]);
 }
@@ -56,5 +79,9 @@ int notifier_read() {
 
 int notifier_write() {
     char c = 'x';
+    __sync_synchronize();
+    if (*spinning) {
+        return 1;
+    }
     return write(pipe_fds[1], &c, 1);
 }
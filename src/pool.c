@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define POOL_ALIGN(n) \
+    (((n) + (sizeof(long double) - 1)) & ~(sizeof(long double) - 1))
+
+typedef struct pool_block {
+    struct pool_block   *next;
+    char                *last;  /* the free space starts here */
+    char                *end;
+    long double         data[0];
+} pool_block_t;
+
+typedef struct pool_large {
+    struct pool_large   *next;
+    long double         data[0];
+} pool_large_t;
+
+struct pool {
+    pool_block_t    *first;
+    pool_block_t    *current;
+    pool_large_t    *large;
+    size_t          block_size;
+};
+
+static pool_block_t *block_create(size_t size) {
+    pool_block_t *b = (pool_block_t *)malloc(sizeof(*b) + size);
+
+    if (!b) {
+        return NULL;
+    }
+    b->next = NULL;
+    b->last = (char *)b->data;
+    b->end = b->last + size;
+    return b;
+}
+
+pool_t *pool_create(size_t block_size) {
+    pool_t *p = (pool_t *)malloc(sizeof(*p));
+
+    if (!p) {
+        return NULL;
+    }
+    p->block_size = POOL_ALIGN(block_size);
+    p->first = block_create(p->block_size);
+    if (!p->first) {
+        free(p);
+        return NULL;
+    }
+    p->current = p->first;
+    p->large = NULL;
+    return p;
+}
+
+void pool_free(pool_t *p) {
+    pool_block_t *b, *next;
+
+    pool_reset(p);
+    for (b = p->first; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(p);
+}
+
+void *pool_alloc(pool_t *p, size_t size) {
+    pool_block_t *b;
+    pool_large_t *l;
+    char *m;
+
+    size = POOL_ALIGN(size);
+    if (size > p->block_size / 2) {
+        l = (pool_large_t *)malloc(sizeof(*l) + size);
+        if (!l) {
+            return NULL;
+        }
+        l->next = p->large;
+        p->large = l;
+        return l->data;
+    }
+
+    /* Move on to the next block, a new one when all are full. */
+    for (b = p->current; b; b = b->next) {
+        if ((size_t)(b->end - b->last) >= size) {
+            m = b->last;
+            b->last += size;
+            p->current = b;
+            return m;
+        }
+        if (!b->next) {
+            b->next = block_create(p->block_size);
+        }
+    }
+    return NULL;
+}
+
+char *pool_strndup(pool_t *p, const char *s, size_t n) {
+    char *d;
+
+    n = strnlen(s, n);
+    d = (char *)pool_alloc(p, n + 1);
+    if (!d) {
+        return NULL;
+    }
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+/* The blocks grown into are freed, so a burst doesn't pin its memory to
+ * the pool. */
+void pool_reset(pool_t *p) {
+    pool_block_t *b, *next;
+    pool_large_t *l, *lnext;
+
+    for (l = p->large; l; l = lnext) {
+        lnext = l->next;
+        free(l);
+    }
+    p->large = NULL;
+
+    for (b = p->first->next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    p->first->next = NULL;
+    p->first->last = (char *)p->first->data;
+    p->current = p->first;
+}
+
+/* gcc pool.c -DPOOL_TEST_MAIN -I../inc -g */
+#ifdef POOL_TEST_MAIN
+#include <stdio.h>
+#include <assert.h>
+
+static int in_block(pool_block_t *b, void *m) {
+    return (char *)m >= (char *)b->data && (char *)m < b->end;
+}
+
+int main(int argc, char *argv[]) {
+    pool_t *p = pool_create(256);
+    pool_block_t *first = p->first;
+    char *m, *s;
+    int i;
+
+    /* Aligned for any type, whatever was asked before */
+    for (i = 1; i <= 40; ++i) {
+        m = pool_alloc(p, i);
+        assert(m && ((unsigned long)m % sizeof(long double)) == 0);
+        memset(m, 0xaa, i);
+    }
+    assert(first->next != NULL);
+    printf("alignment ok\n");
+
+    /* Over half a block, allocated on its own */
+    m = pool_alloc(p, 129);
+    assert(m && p->large && (char *)p->large->data == m);
+    assert(!in_block(p->current, m));
+    memset(m, 0xbb, 129);
+    m = pool_alloc(p, 128);
+    assert(m && in_block(p->current, m));
+    printf("large ok\n");
+
+    /* The blocks grown into and the large chunks are dropped */
+    pool_reset(p);
+    assert(p->first == first && p->current == first);
+    assert(first->next == NULL && p->large == NULL);
+    m = pool_alloc(p, 16);
+    assert(m == (char *)first->data);
+    printf("reset ok\n");
+
+    /* Copied up to `n' bytes or the NUL, terminated */
+    s = pool_strndup(p, "hello world", 5);
+    assert(s && !strcmp(s, "hello"));
+    s = pool_strndup(p, "hi", 16);
+    assert(s && !strcmp(s, "hi"));
+    s = pool_strndup(p, "", 0);
+    assert(s && s[0] == '\0');
+    printf("strndup ok\n");
+
+    pool_free(p);
+    exit(0);
+}
+#endif /* POOL_TEST_MAIN */
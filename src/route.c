@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "verben.h"
+#include "route.h"
+#include "affinity.h"
+#include "anet.h"
+#include "log.h"
+
+typedef struct route_worker {
+    volatile int    load;       /* requests queued or running */
+    volatile int    idle;       /* shared policy, asleep on its pipe */
+} route_worker;
+
+/* Shared by the master, the conn and the worker processes. */
+typedef struct route_table {
+    volatile int    nworkers;   /* workers taking requests */
+    route_worker    workers[0];
+} route_table;
+
+static int          policy;
+static int          max_workers;
+static route_table  *table = MAP_FAILED;
+static shmq_t       **queues;
+static int          (*pipes)[2];
+static int          self = -1;  /* index of the worker process */
+
+/* In the conn process, the workers to wake up when flushing. */
+static int          *woken;
+static char         *wake_pending;
+static int          nwoken;
+static int          npushed;    /* shared policy, requests to wake for */
+static unsigned int next_worker;
+
+static const char *policies[] = {
+    "shared", "conn", "key", "least_loaded", NULL
+};
+
+/* Jump consistent hash, a key keeps its worker while the pool is
+ * unchanged, and only 1/n of the keys move when it grows by one. */
+static int jump_hash(unsigned long long key, int buckets) {
+    long long b = -1, j = 0;
+
+    while (j < buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+    return (int)b;
+}
+
+static int least_loaded(int n) {
+    int i, w, best, min;
+
+    /* Start from the next worker round-robin, so ties are spread. */
+    best = next_worker++ % n;
+    min = table->workers[best].load;
+    for (i = 1; i < n && min > 0; ++i) {
+        w = (best + i) % n;
+        if (table->workers[w].load < min) {
+            min = table->workers[w].load;
+            best = w;
+        }
+    }
+    return best;
+}
+
+static int select_worker(client_conn *cli, shm_msg *msg, int len) {
+    int n = table->nworkers;
+    int key;
+
+    if (n <= 1) {
+        return 0;
+    }
+
+    switch (policy) {
+    case ROUTE_KEY:
+        key = dll.handle_route(msg->data, len - sizeof(shm_msg),
+                cli->remote_ip, cli->remote_port);
+        if (key >= 0) {
+            return jump_hash((unsigned long long)key, n);
+        }
+        /* No key, stick to the connection. */
+        return jump_hash(cli->id, n);
+    case ROUTE_LEAST_LOADED:
+        return least_loaded(n);
+    default:
+        return jump_hash(cli->id, n);
+    }
+}
+
+int route_init(conf_t *conf, int nworkers, int max) {
+    char    *name = conf_get_str_value(conf, "route", "shared");
+    char    err[ANET_ERR_LEN];
+    size_t  size, len;
+    void    *addr;
+    int     i;
+
+    for (policy = 0; policies[policy]; ++policy) {
+        if (!strcmp(policies[policy], name)) {
+            break;
+        }
+    }
+    if (!policies[policy]) {
+        boot_notify(-1, "Unknown route %s", name);
+        return -1;
+    }
+    if (policy == ROUTE_KEY && !dll.handle_route) {
+        boot_notify(-1, "route key requires the hook handle_route");
+        return -1;
+    }
+
+    max_workers = max;
+    table = mmap(NULL, sizeof(route_table) + sizeof(route_worker) * max,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    queues = (shmq_t **)calloc(max, sizeof(shmq_t *));
+    pipes = calloc(max, sizeof(*pipes));
+    woken = (int *)calloc(max, sizeof(int));
+    wake_pending = (char *)calloc(max, 1);
+    if (table == MAP_FAILED || !queues || !pipes || !woken
+            || !wake_pending) {
+        boot_notify(-1, "Allocate the route table");
+        return -1;
+    }
+    memset(table->workers, 0, sizeof(route_worker) * max);
+    table->nworkers = nworkers;
+
+    /* The shared policy has the queue of all the workers, but a wakeup
+     * pipe per worker too, so that a request wakes up a single one. */
+    size = conf_get_int_value(conf, "shmq_recv", 1 << 20);
+    for (i = 0; i < max; ++i) {
+        if (policy != ROUTE_SHARED) {
+            if (!(queues[i] = shmq_create(size))) {
+                boot_notify(-1, "Create receiving queue of worker %d", i);
+                return -1;
+            }
+            addr = shmq_memory(queues[i], &len);
+            affinity_bind_memory(addr, len);
+        }
+
+        if (pipe(pipes[i]) < 0
+                || anet_nonblock(err, pipes[i][0]) != ANET_OK
+                || anet_nonblock(err, pipes[i][1]) != ANET_OK) {
+            boot_notify(-1, "Create wakeup pipe of worker %d", i);
+            return -1;
+        }
+        fcntl(pipes[i][0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipes[i][1], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+void route_free(void) {
+    int i;
+
+    if (table == MAP_FAILED) {
+        return; /* thread mode */
+    }
+    for (i = 0; i < max_workers; ++i) {
+        if (queues[i]) {
+            shmq_free(queues[i]);
+        }
+    }
+    free(queues);
+    free(pipes);
+    free(woken);
+    free(wake_pending);
+    munmap((void *)table, 
+            sizeof(route_table) + sizeof(route_worker) * max_workers);
+}
+
+int route_policy(void) {
+    return policy;
+}
+
+void route_set_workers(int n) {
+    if (table != MAP_FAILED) {
+        table->nworkers = n;
+    }
+}
+
+int route_queued(void) {
+    int i, n = 0;
+
+    if (policy == ROUTE_SHARED) {
+        return shmq_count(recv_queue);
+    }
+    for (i = 0; i < max_workers; ++i) {
+        n += shmq_count(queues[i]);
+    }
+    return n;
+}
+
+int route_push(client_conn *cli, shm_msg *msg, int len) {
+    int w;
+
+    if (policy == ROUTE_SHARED) {
+        if (shmq_push(recv_queue, msg, len, 0) != 0) {
+            return -1;
+        }
+        ++npushed;
+        return 0;
+    }
+
+    w = select_worker(cli, msg, len);
+    if (shmq_push(queues[w], msg, len, 0) != 0) {
+        return -1;
+    }
+    __sync_fetch_and_add(&table->workers[w].load, 1);
+    if (!wake_pending[w]) {
+        wake_pending[w] = 1;
+        woken[nwoken++] = w;
+    }
+    return 0;
+}
+
+static int wake_worker(int w) {
+    char c = 'x';
+
+    if (write(pipes[w][1], &c, 1) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    return 0;
+}
+
+/* With the shared queue, wake up an idle worker per request, round-robin.
+ * The busy workers pop the rest before falling asleep, see route_sleep().
+ * The barrier pairs with the one there: either we see the worker idle or
+ * it sees the requests. */
+static int wake_idle(int n) {
+    int i, w, nworkers = table->nworkers, ret = 0;
+
+    __sync_synchronize();
+    for (i = 0; i < nworkers && n > 0; ++i) {
+        w = next_worker++ % nworkers;
+        if (table->workers[w].idle 
+                && __sync_bool_compare_and_swap(&table->workers[w].idle, 
+                    1, 0)) {
+            if (wake_worker(w) < 0) {
+                ret = -1;
+            }
+            --n;
+        }
+    }
+    return ret;
+}
+
+/* A worker pipe wakes up only the worker which got requests. */
+int route_wake(void) {
+    int i, w, ret = 0;
+
+    if (policy == ROUTE_SHARED) {
+        ret = wake_idle(npushed);
+        npushed = 0;
+        return ret;
+    }
+
+    for (i = 0; i < nwoken; ++i) {
+        w = woken[i];
+        wake_pending[w] = 0;
+        if (wake_worker(w) < 0) {
+            ret = -1;
+        }
+    }
+    nwoken = 0;
+    return ret;
+}
+
+/* A worker respawned after a crash starts over with the requests left
+ * in its queue, those it was running are lost. */
+void route_attach(int index) {
+    self = index;
+    if (policy != ROUTE_SHARED) {
+        table->workers[self].load = shmq_count(queues[self]);
+        return;
+    }
+    /* Not idle until it has looked at the queue. */
+    table->workers[self].idle = 0;
+    wake_worker(self);
+}
+
+/* A worker leaving the shared queue passes on a wakeup it may have taken
+ * from the conn process. */
+void route_detach(void) {
+    if (policy != ROUTE_SHARED) {
+        return;
+    }
+    table->workers[self].idle = 0;
+    __sync_synchronize();
+    if (shmq_count(recv_queue) > 0) {
+        wake_idle(1);
+    }
+}
+
+int route_read_fd(void) {
+    return pipes[self][0];
+}
+
+int route_read(void) {
+    char buf[64];
+
+    return read(pipes[self][0], buf, sizeof(buf));
+}
+
+int route_wake_self(void) {
+    return wake_worker(self);
+}
+
+/* The worker found the shared queue empty and is about to sleep. Returns
+ * 1 if requests were pushed meanwhile and nobody will wake it up for 
+ * them, the worker has to go on. */
+int route_sleep(void) {
+    if (policy != ROUTE_SHARED) {
+        return 0;
+    }
+    table->workers[self].idle = 1;
+    __sync_synchronize();
+    if (shmq_count(recv_queue) == 0) {
+        return 0;
+    }
+    /* Unless the conn process has just taken the flag to wake us up. */
+    return __sync_bool_compare_and_swap(&table->workers[self].idle, 1, 0);
+}
+
+/* The queue of a worker has the conn process as the only producer and
+ * the worker as the only consumer, no lock is needed. */
+int route_pop(shm_msg **msg, int *len) {
+    if (policy == ROUTE_SHARED) {
+        return shmq_pop(recv_queue, (void **)msg, len, SHMQ_LOCK);
+    }
+    return shmq_pop(queues[self], (void **)msg, len, 0);
+}
+
+int route_pop_batch(shm_msg **msgs, int *lens, int max) {
+    if (policy == ROUTE_SHARED) {
+        return shmq_pop_batch(recv_queue, (void **)msgs, lens, max,
+                SHMQ_LOCK);
+    }
+    return shmq_pop_batch(queues[self], (void **)msgs, lens, max, 0);
+}
+
+int route_queued_self(void) {
+    if (policy == ROUTE_SHARED) {
+        return shmq_count(recv_queue);
+    }
+    return shmq_count(queues[self]);
+}
+
+/* A request of the worker is answered. */
+void route_done(void) {
+    if (policy != ROUTE_SHARED) {
+        __sync_fetch_and_sub(&table->workers[self].load, 1);
+    }
+}
+
+/* A retired worker doesn't get new requests, but has to answer those
+ * already in its queue. */
+int route_retired(void) {
+    return policy != ROUTE_SHARED && self >= table->nworkers;
+}
@@ -112,6 +112,17 @@ void shmq_destroy(shmq_t *q) {
     }
 }
 
+/* The number of messages in the queue. */
+int shmq_count(shmq_t *q) {
+    return atomic_read(&q->addr->blk_cnt);
+}
+
+/* The shared memory region of the queue. */
+void *shmq_memory(shmq_t *q, size_t *len) {
+    *len = q->size;
+    return q->addr;
+}
+
 void shmq_free(shmq_t *q) {
     assert(q);
     shmq_destroy(q);
@@ -273,6 +284,24 @@ shmq_pop_stop:
     return 1;
 }
 
+/* Pop up to `max' messages with the lock taken once. Returns the number
+ * of messages popped, 0 if the lock can't be taken. */
+int shmq_pop_batch(shmq_t *q, void **retdata, int *len, int max, 
+        int flag) {
+    int n;
+
+    if ((flag & SHMQ_LOCK) && LOCK_LOCK(&q->addr->lock) != 0) {
+        return 0;
+    }
+    for (n = 0; n < max; ++n) {
+        if (shmq_pop(q, &retdata[n], &len[n], 0) != 0) {
+            break;
+        }
+    }
+    OPT_UNLOCK(&q->addr->lock, flag);
+    return n;
+}
+
 /* gcc shmq.c lock.c -DSHMQ_TEST_MAIN -I../inc -lpthread -g */
 #ifdef SHMQ_TEST_MAIN
 #include <stdio.h>
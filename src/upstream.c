@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include "upstream.h"
+#include "anet.h"
+#include "sds.h"
+
+#define UPSTREAM_CRON_MS        10
+#define UPSTREAM_IOBUF_SIZE     (16 * 1024)
+
+typedef struct upstream_req {
+    struct upstream_req *next;
+    upstream_callback   *cb;
+    void                *privdata;
+    long long           deadline;   /* in milliseconds, 0 for none */
+    int                 status;     /* when it's on the done list */
+    int                 len;
+    char                data[];
+} upstream_req;
+
+typedef struct upstream_conn {
+    upstream_t          *up;
+    int                 fd;
+    int                 connected;
+    int                 writing;    /* the writable event is installed */
+    sds                 obuf;
+    sds                 ibuf;
+    upstream_req        *head;      /* requests sent, in order */
+    upstream_req        *tail;
+    int                 inflight;
+    long long           last_active;
+} upstream_conn;
+
+struct upstream {
+    ae_event_loop       *el;
+    char                *host;
+    int                 port;
+    upstream_input_proc *input;
+    int                 max_conns;
+    int                 pipeline;
+    int                 max_inflight;
+    int                 timeout;
+    int                 idle_timeout;
+    upstream_conn       **conns;
+    int                 nconns;
+    int                 size;       /* size of `conns' */
+    upstream_req        *wait_head; /* requests waiting for a connection */
+    upstream_req        *wait_tail;
+    upstream_req        *done_head; /* failed, the callbacks are pending */
+    upstream_req        *done_tail;
+    long long           cron_id;
+    int                 freeing;
+    upstream_stats_t    stats;
+};
+
+static void write_handler(ae_event_loop *el, int fd, void *privdata,
+        int mask);
+
+static long long mstime(void) {
+    struct timeval tv;
+    long long mst;
+
+    gettimeofday(&tv, NULL);
+    mst = ((long long)tv.tv_sec) * 1000;
+    mst += tv.tv_usec / 1000;
+    return mst;
+}
+
+static void req_append(upstream_req **head, upstream_req **tail,
+        upstream_req *req) {
+    req->next = NULL;
+    if (*tail) {
+        (*tail)->next = req;
+    } else {
+        *head = req;
+    }
+    *tail = req;
+}
+
+/* Move the requests to the done list, the callbacks are invoked later
+ * in run_done(), when the connections are in a consistent state. */
+static void req_fail(upstream_t *up, upstream_req *req, int status) {
+    upstream_req *next;
+
+    for ( ; req; req = next) {
+        next = req->next;
+        req->status = status;
+        if (status == UPSTREAM_TIMEOUT) {
+            ++up->stats.timeouts;
+        } else {
+            ++up->stats.errors;
+        }
+        req_append(&up->done_head, &up->done_tail, req);
+    }
+}
+
+static void run_done(upstream_t *up) {
+    upstream_req *req;
+
+    while ((req = up->done_head) != NULL) {
+        up->done_head = req->next;
+        if (!up->done_head) {
+            up->done_tail = NULL;
+        }
+        req->cb(req->status, NULL, 0, req->privdata);
+        free(req);
+    }
+}
+
+static void conn_close(upstream_conn *c, int status) {
+    upstream_t *up = c->up;
+    int i;
+
+    for (i = 0; i < up->nconns; ++i) {
+        if (up->conns[i] == c) {
+            up->conns[i] = up->conns[--up->nconns];
+            break;
+        }
+    }
+
+    up->stats.inflight -= c->inflight;
+    req_fail(up, c->head, status);
+
+    ae_delete_file_event(up->el, c->fd, AE_READABLE | AE_WRITABLE);
+    close(c->fd);
+    sdsfree(c->obuf);
+    sdsfree(c->ibuf);
+    free(c);
+}
+
+/* Write as much as possible, the rest is left to the write handler.
+ * Errors are left to the handlers too. */
+static void conn_flush(upstream_conn *c) {
+    int nwritten = 0;
+
+    if (c->connected && sdslen(c->obuf) > 0) {
+        nwritten = write(c->fd, c->obuf, sdslen(c->obuf));
+        if (nwritten > 0) {
+            c->obuf = sdsrange(c->obuf, nwritten, -1);
+        }
+    }
+
+    if (sdslen(c->obuf) == 0 && c->connected) {
+        if (c->writing) {
+            ae_delete_file_event(c->up->el, c->fd, AE_WRITABLE);
+            c->writing = 0;
+        }
+    } else if (!c->writing) {
+        if (ae_create_file_event(c->up->el, c->fd, AE_WRITABLE,
+                    write_handler, c) == AE_OK) {
+            c->writing = 1;
+        }
+    }
+}
+
+static void dispatch(upstream_t *up);
+
+static void read_handler(ae_event_loop *el, int fd, void *privdata,
+        int mask) {
+    upstream_conn *c = (upstream_conn *)privdata;
+    upstream_t *up = c->up;
+    upstream_req *req;
+    char buf[UPSTREAM_IOBUF_SIZE];
+    int nread;
+    int len;
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    nread = read(fd, buf, sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) {
+        return;
+    } else if (nread <= 0) {
+        /* An idle connection closed by the backend fails nothing. */
+        conn_close(c, UPSTREAM_ERROR);
+        goto out;
+    }
+    c->ibuf = sdscatlen(c->ibuf, buf, nread);
+    c->last_active = mstime();
+
+    while (c->head && sdslen(c->ibuf) > 0) {
+        len = up->input(c->ibuf, sdslen(c->ibuf));
+        if (len < 0 || len > (int)sdslen(c->ibuf)) {
+            conn_close(c, UPSTREAM_ERROR);
+            goto out;
+        } else if (len == 0) {
+            break;
+        }
+
+        req = c->head;
+        c->head = req->next;
+        if (!c->head) {
+            c->tail = NULL;
+        }
+        --c->inflight;
+        --up->stats.inflight;
+
+        req->cb(UPSTREAM_OK, c->ibuf, len, req->privdata);
+        free(req);
+        c->ibuf = sdsrange(c->ibuf, len, -1);
+    }
+
+    if (!c->head && sdslen(c->ibuf) > 0) {
+        /* Data nobody asked for, the stream is out of sync. */
+        conn_close(c, UPSTREAM_ERROR);
+    }
+
+out:
+    run_done(up);
+    dispatch(up);
+}
+
+static void write_handler(ae_event_loop *el, int fd, void *privdata,
+        int mask) {
+    upstream_conn *c = (upstream_conn *)privdata;
+    upstream_t *up = c->up;
+    int err = 0;
+    int nwritten;
+    socklen_t errlen = sizeof(err);
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    if (!c->connected) {
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1
+                || err) {
+            conn_close(c, UPSTREAM_ERROR);
+            goto out;
+        }
+        c->connected = 1;
+    }
+
+    if (sdslen(c->obuf) > 0) {
+        nwritten = write(fd, c->obuf, sdslen(c->obuf));
+        if (nwritten == -1) {
+            if (errno != EAGAIN) {
+                conn_close(c, UPSTREAM_ERROR);
+                goto out;
+            }
+            return;
+        }
+        c->obuf = sdsrange(c->obuf, nwritten, -1);
+    }
+
+    if (sdslen(c->obuf) == 0) {
+        ae_delete_file_event(el, fd, AE_WRITABLE);
+        c->writing = 0;
+    }
+    return;
+
+out:
+    run_done(up);
+    dispatch(up);
+}
+
+static upstream_conn *conn_create(upstream_t *up) {
+    upstream_conn *c;
+    upstream_conn **conns;
+    int fd;
+
+    if (up->nconns == up->size) {
+        conns = (upstream_conn **)realloc(up->conns,
+                sizeof(*conns) * (up->size ? up->size * 2 : 4));
+        if (!conns) {
+            return NULL;
+        }
+        up->conns = conns;
+        up->size = up->size ? up->size * 2 : 4;
+    }
+
+    fd = anet_tcp_nonblock_connect(NULL, up->host, up->port);
+    if (fd == ANET_ERR) {
+        return NULL;
+    }
+    anet_tcp_nodelay(NULL, fd);
+
+    c = (upstream_conn *)calloc(1, sizeof(*c));
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->up = up;
+    c->fd = fd;
+    c->obuf = sdsempty();
+    c->ibuf = sdsempty();
+    c->last_active = mstime();
+
+    /* The writable event tells when the connection is established. */
+    if (ae_create_file_event(up->el, fd, AE_READABLE,
+                read_handler, c) == AE_ERR
+            || ae_create_file_event(up->el, fd, AE_WRITABLE,
+                write_handler, c) == AE_ERR) {
+        ae_delete_file_event(up->el, fd, AE_READABLE | AE_WRITABLE);
+        close(fd);
+        sdsfree(c->obuf);
+        sdsfree(c->ibuf);
+        free(c);
+        return NULL;
+    }
+    c->writing = 1;
+
+    up->conns[up->nconns++] = c;
+    ++up->stats.connects;
+    return c;
+}
+
+/* The connection with the fewest requests in flight. A new one is
+ * opened rather than pipelining while the pool isn't full. */
+static upstream_conn *pick_conn(upstream_t *up) {
+    upstream_conn *best = NULL;
+    upstream_conn *c;
+    int i;
+
+    for (i = 0; i < up->nconns; ++i) {
+        c = up->conns[i];
+        if (c->inflight < up->pipeline
+                && (!best || c->inflight < best->inflight)) {
+            best = c;
+        }
+    }
+
+    if ((!best || best->inflight > 0) && up->nconns < up->max_conns) {
+        if ((c = conn_create(up)) != NULL) {
+            return c;
+        }
+    }
+    return best;
+}
+
+static void dispatch(upstream_t *up) {
+    upstream_conn *c;
+    upstream_req *req;
+
+    while (up->wait_head && up->stats.inflight < up->max_inflight) {
+        if (!(c = pick_conn(up))) {
+            break;
+        }
+
+        req = up->wait_head;
+        up->wait_head = req->next;
+        if (!up->wait_head) {
+            up->wait_tail = NULL;
+        }
+        --up->stats.waiting;
+
+        c->obuf = sdscatlen(c->obuf, req->data, req->len);
+        req_append(&c->head, &c->tail, req);
+        ++c->inflight;
+        ++up->stats.inflight;
+        conn_flush(c);
+    }
+}
+
+/* Fail the requests out of time, close the idle connections and retry
+ * connecting for the waiting requests. A timed out connection is closed
+ * since the responses behind would be out of sync. */
+static int upstream_cron(ae_event_loop *el, long long id, void *privdata) {
+    upstream_t *up = (upstream_t *)privdata;
+    upstream_req *req, **link;
+    upstream_conn *c;
+    long long now = mstime();
+    int i;
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+
+    link = &up->wait_head;
+    up->wait_tail = NULL;
+    while ((req = *link) != NULL) {
+        if (req->deadline && req->deadline <= now) {
+            *link = req->next;
+            --up->stats.waiting;
+            req->next = NULL;
+            req_fail(up, req, UPSTREAM_TIMEOUT);
+        } else {
+            up->wait_tail = req;
+            link = &req->next;
+        }
+    }
+
+    for (i = up->nconns - 1; i >= 0; --i) {
+        c = up->conns[i];
+        if (c->head) {
+            if (c->head->deadline && c->head->deadline <= now) {
+                conn_close(c, UPSTREAM_TIMEOUT);
+            }
+        } else if (up->idle_timeout
+                && now - c->last_active >= up->idle_timeout) {
+            conn_close(c, UPSTREAM_ERROR);
+        }
+    }
+
+    run_done(up);
+    dispatch(up);
+    return UPSTREAM_CRON_MS;
+}
+
+upstream_t *upstream_create(ae_event_loop *el, char *host, int port,
+        upstream_input_proc *input) {
+    upstream_t *up = (upstream_t *)calloc(1, sizeof(*up));
+    if (!up) {
+        return NULL;
+    }
+
+    up->el = el;
+    up->port = port;
+    up->input = input;
+    up->host = strdup(host);
+    if (!up->host) {
+        free(up);
+        return NULL;
+    }
+    upstream_set_limits(up, 4, 1, 1024, 1000, 60000);
+
+    up->cron_id = ae_create_time_event(el, UPSTREAM_CRON_MS,
+            upstream_cron, up, NULL);
+    if (up->cron_id == AE_ERR) {
+        free(up->host);
+        free(up);
+        return NULL;
+    }
+    return up;
+}
+
+/* The requests outstanding fail with UPSTREAM_ERROR. */
+void upstream_free(upstream_t *up) {
+    upstream_req *req;
+
+    up->freeing = 1;
+    while (up->nconns) {
+        conn_close(up->conns[0], UPSTREAM_ERROR);
+    }
+
+    req = up->wait_head;
+    up->wait_head = up->wait_tail = NULL;
+    req_fail(up, req, UPSTREAM_ERROR);
+    run_done(up);
+
+    ae_delete_time_event(up->el, up->cron_id);
+    free(up->conns);
+    free(up->host);
+    free(up);
+}
+
+void upstream_set_limits(upstream_t *up, int max_conns, int pipeline,
+        int max_inflight, int timeout, int idle_timeout) {
+    up->max_conns = max_conns > 0 ? max_conns : 1;
+    up->pipeline = pipeline > 0 ? pipeline : 1;
+    up->max_inflight = max_inflight > 0 ? max_inflight : 1;
+    up->timeout = timeout > 0 ? timeout : 0;
+    up->idle_timeout = idle_timeout > 0 ? idle_timeout : 0;
+}
+
+int upstream_request(upstream_t *up, const char *buf, int len,
+        upstream_callback *cb, void *privdata) {
+    upstream_req *req;
+
+    if (up->freeing || len < 0) {
+        return -1;
+    }
+
+    req = (upstream_req *)malloc(sizeof(*req) + len);
+    if (!req) {
+        return -1;
+    }
+    req->cb = cb;
+    req->privdata = privdata;
+    req->deadline = up->timeout ? mstime() + up->timeout : 0;
+    req->status = UPSTREAM_OK;
+    req->len = len;
+    memcpy(req->data, buf, len);
+
+    req_append(&up->wait_head, &up->wait_tail, req);
+    ++up->stats.waiting;
+    ++up->stats.requests;
+    dispatch(up);
+    return 0;
+}
+
+void upstream_get_stats(upstream_t *up, upstream_stats_t *stats) {
+    *stats = up->stats;
+    stats->conns = up->nconns;
+}
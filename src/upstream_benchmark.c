@@ -0,0 +1,318 @@
+/* Measures the per-request overhead of the upstream connection pool
+ * against a loopback echo server forked as the stand-in backend. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "ae.h"
+#include "anet.h"
+#include "upstream.h"
+
+static int quit;
+
+static struct config {
+    ae_event_loop   *el;
+    upstream_t      *up;
+    char            *hostip;
+    int             hostport;
+    int             requests;
+    int             requests_issued;
+    int             requests_finished;
+    int             requests_failed;
+    int             concurrency;
+    int             max_conns;
+    int             pipeline;
+    int             size;
+    int             blocking;
+    int             quiet;
+    char            *payload;
+    long long       total_latency;
+} conf;
+
+static long long ustime() {
+    struct timeval tv;
+    long long ust;
+
+    gettimeofday(&tv, NULL);
+    ust = ((long)tv.tv_sec) * 1000000;
+    ust += tv.tv_usec;
+    return ust;
+}
+
+/* The stand-in backend, it echoes everything back. */
+static void server_read(ae_event_loop *el, int fd, void *priv, int mask) {
+    char buf[16 * 1024];
+    int nread;
+
+    nread = read(fd, buf, sizeof(buf));
+    if (nread <= 0) {
+        if (nread == -1 && errno == EAGAIN) {
+            return;
+        }
+        ae_delete_file_event(el, fd, AE_READABLE);
+        close(fd);
+        return;
+    }
+
+    if (anet_write(fd, buf, nread) != nread) {
+        ae_delete_file_event(el, fd, AE_READABLE);
+        close(fd);
+    }
+}
+
+static void server_accept(ae_event_loop *el, int fd, void *priv, int mask) {
+    char ip[128];
+    int port;
+    int cfd;
+
+    cfd = anet_tcp_accept(NULL, fd, ip, &port);
+    if (cfd == ANET_ERR) {
+        return;
+    }
+    anet_tcp_nodelay(NULL, cfd);
+    if (ae_create_file_event(el, cfd, AE_READABLE,
+                server_read, NULL) == AE_ERR) {
+        close(cfd);
+    }
+}
+
+static pid_t spawn_server(void) {
+    char err[ANET_ERR_LEN];
+    ae_event_loop *el;
+    int listen_fd;
+    pid_t pid;
+
+    listen_fd = anet_tcp_server(err, conf.hostip, conf.hostport);
+    if (listen_fd == ANET_ERR) {
+        fprintf(stderr, "Listen on %s:%d failed: %s\n",
+                conf.hostip, conf.hostport, err);
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        exit(1);
+    } else if (pid > 0) {
+        close(listen_fd);
+        return pid;
+    }
+
+    el = ae_create_event_loop();
+    ae_create_file_event(el, listen_fd, AE_READABLE, server_accept, NULL);
+    ae_main(el, &quit);
+    exit(0);
+}
+
+static int line_input(const char *buf, int len) {
+    char *p = memchr(buf, '\n', len);
+    return p ? p - buf + 1 : 0;
+}
+
+static void issue_request(void);
+
+static void request_done(int status, const char *buf, int len,
+        void *privdata) {
+    long long start = (long long)(long)privdata;
+
+    if (status != UPSTREAM_OK || len != conf.size) {
+        ++conf.requests_failed;
+    }
+    conf.total_latency += ustime() - start;
+
+    if (++conf.requests_finished == conf.requests) {
+        quit = 1;
+        return;
+    }
+    issue_request();
+}
+
+static void issue_request(void) {
+    if (conf.requests_issued >= conf.requests) {
+        return;
+    }
+    ++conf.requests_issued;
+    if (upstream_request(conf.up, conf.payload, conf.size, request_done,
+                (void *)(long)ustime()) != 0) {
+        fprintf(stderr, "upstream_request failed\n");
+        exit(1);
+    }
+}
+
+static void benchmark_pool(void) {
+    upstream_stats_t stats;
+    long long start, elapsed;
+    int i;
+
+    conf.el = ae_create_event_loop();
+    conf.up = upstream_create(conf.el, conf.hostip, conf.hostport,
+            line_input);
+    if (!conf.up) {
+        fprintf(stderr, "upstream_create failed\n");
+        exit(1);
+    }
+    upstream_set_limits(conf.up, conf.max_conns, conf.pipeline,
+            conf.concurrency, 5000, 0);
+
+    start = ustime();
+    for (i = 0; i < conf.concurrency; ++i) {
+        issue_request();
+    }
+    ae_main(conf.el, &quit);
+    elapsed = ustime() - start;
+
+    upstream_get_stats(conf.up, &stats);
+    if (!conf.quiet) {
+        printf("========== upstream pool ==========\n");
+        printf(" %d requests completed in %.2f seconds\n",
+                conf.requests_finished, (float)elapsed / 1000000);
+        printf(" %d concurrent, %d connections, pipeline %d\n",
+                conf.concurrency, conf.max_conns, conf.pipeline);
+        printf(" %lld connects, %d failed\n", stats.connects,
+                conf.requests_failed);
+        printf(" %.2f usec average latency\n",
+                (float)conf.total_latency / conf.requests_finished);
+        printf("\n");
+    }
+    printf("pool:%.2f requests per second, %.2f usec per request\n",
+            (float)conf.requests_finished * 1000000 / elapsed,
+            (float)elapsed / conf.requests_finished);
+
+    upstream_free(conf.up);
+    ae_free_event_loop(conf.el);
+}
+
+/* What the plugins did before: a blocking connect per request. */
+static void benchmark_blocking(void) {
+    char err[ANET_ERR_LEN];
+    char *buf;
+    long long start, elapsed;
+    int i, fd, nread, total;
+
+    buf = malloc(conf.size);
+    start = ustime();
+    for (i = 0; i < conf.blocking; ++i) {
+        fd = anet_tcp_connect(err, conf.hostip, conf.hostport);
+        if (fd == ANET_ERR) {
+            fprintf(stderr, "Connect failed: %s\n", err);
+            exit(1);
+        }
+        anet_tcp_nodelay(NULL, fd);
+        if (anet_write(fd, conf.payload, conf.size) != conf.size) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (total = 0; total < conf.size; total += nread) {
+            nread = read(fd, buf + total, conf.size - total);
+            if (nread <= 0) {
+                fprintf(stderr, "read failed\n");
+                exit(1);
+            }
+        }
+        close(fd);
+    }
+    elapsed = ustime() - start;
+    free(buf);
+
+    printf("blocking:%.2f requests per second, %.2f usec per request\n",
+            (float)conf.blocking * 1000000 / elapsed,
+            (float)elapsed / conf.blocking);
+}
+
+static void usage(int status) {
+    puts("Usage: upstream_benchmark [-p <port>] [-n <requests>] "
+            "[-c <concurrency>] [-C <conns>] [-P <pipeline>] "
+            "[-s <size>] [-b <requests>]\n");
+    puts(" -p <port>        stand-in server port (default 8774)");
+    puts(" -n <requests>    total number of requests (default 100000)");
+    puts(" -c <concurrency> requests in flight (default 64)");
+    puts(" -C <conns>       connections of the pool (default 4)");
+    puts(" -P <pipeline>    requests pipelined per connection "
+            "(default 16)");
+    puts(" -s <size>        request size (default 64)");
+    puts(" -b <requests>    also run requests with a blocking connect "
+            "each (default 0)");
+    puts(" -q               quiet. Just show the results");
+    puts(" -H               show help information\n");
+    exit(status);
+}
+
+static void parse_options(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "p:n:c:C:P:s:b:qH")) != -1) {
+        switch (c) {
+        case 'p':
+            conf.hostport = atoi(optarg);
+            break;
+        case 'n':
+            conf.requests = atoi(optarg);
+            break;
+        case 'c':
+            conf.concurrency = atoi(optarg);
+            break;
+        case 'C':
+            conf.max_conns = atoi(optarg);
+            break;
+        case 'P':
+            conf.pipeline = atoi(optarg);
+            break;
+        case 's':
+            conf.size = atoi(optarg);
+            break;
+        case 'b':
+            conf.blocking = atoi(optarg);
+            break;
+        case 'q':
+            conf.quiet = 1;
+            break;
+        case 'H':
+            usage(0);
+            break;
+        default:
+            usage(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    pid_t pid;
+
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    conf.hostip = "127.0.0.1";
+    conf.hostport = 8774;
+    conf.requests = 100000;
+    conf.concurrency = 64;
+    conf.max_conns = 4;
+    conf.pipeline = 16;
+    conf.size = 64;
+    conf.blocking = 0;
+    conf.quiet = 0;
+
+    parse_options(argc, argv);
+    if (optind < argc || conf.requests <= 0 || conf.concurrency <= 0
+            || conf.size < 1) {
+        usage(1);
+    }
+
+    conf.payload = malloc(conf.size);
+    memset(conf.payload, 'x', conf.size - 1);
+    conf.payload[conf.size - 1] = '\n';
+
+    pid = spawn_server();
+    benchmark_pool();
+    if (conf.blocking > 0) {
+        benchmark_blocking();
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    exit(0);
+}
@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <assert.h>
 #ifdef __linux__
 #define HAVE_BACKTRACE
@@ -20,6 +21,10 @@
 #include "verben.h"
 #include "daemon.h"
 #include "notifier.h"
+#include "affinity.h"
+#include "route.h"
+#include "framing.h"
+#include "liveness.h"
 #include "shmq.h"
 #include "conn.h"
 #include "worker.h"
@@ -40,6 +45,10 @@
 #define VB_PROCESS_JUST_RESPAWN     -4
 #define VB_PROCESS_DETACHED         -5
 
+/* Ticks in a row before the worker pool is grown, or shrunk. */
+#define SCALE_UP_TICKS              2
+#define SCALE_DOWN_TICKS            10
+
 typedef void (*child_proc_t)(void *);
 
 typedef struct {
@@ -72,6 +81,10 @@ int vb_last_process;
 shmq_t *recv_queue;
 shmq_t *send_queue;
 
+/* bounds of the worker pool */
+int worker_min;
+int worker_max;
+
 int daemon_action;
 char *pid_file;
 
@@ -79,11 +92,12 @@ char *pid_file;
 void * handle;
 dll_func_t dll;
 
-/* conf */
-conf_t   g_conf;
+/* conf and the event loop of the current process */
+vb_cycle_t vb_cycle;
 char *conf_file;
 
 sig_atomic_t vb_reap;
+sig_atomic_t vb_alarm;
 sig_atomic_t vb_quit;
 sig_atomic_t vb_worker_quit;
 static void vb_signal_handler(int signo);
@@ -92,6 +106,7 @@ static vb_signal_t signals[] = {
     {SIGTERM, "SIGTERM", "", vb_signal_handler},
     {SIGQUIT, "SIGQUIT", "", vb_signal_handler},
     {SIGCHLD, "SIGCHLD", "", vb_signal_handler},
+    {SIGALRM, "SIGALRM", "", vb_signal_handler},
     {SIGPIPE, "SIGPIPE, SIG_IGN", "", SIG_IGN},
     {SIGINT, "SIGINT", "", SIG_IGN},
     {0, NULL, "", NULL}
@@ -103,9 +118,19 @@ static symbol_t syms[] = {
     {"handle_fini",         (void **)&dll.handle_fini,          1},
     {"handle_open",         (void **)&dll.handle_open,          1},
     {"handle_close",        (void **)&dll.handle_close,         1},
-    {"handle_input",        (void **)&dll.handle_input,         0},
-    {"handle_process",      (void **)&dll.handle_process,       0},
+    {"handle_input",        (void **)&dll.handle_input,         1},
+    {"handle_process",      (void **)&dll.handle_process,       1},
     {"handle_process_post", (void **)&dll.handle_process_post,  1},
+    {"handle_route",        (void **)&dll.handle_route,         1},
+    {"handle_fast",         (void **)&dll.handle_fast,          1},
+    {"handle_reject",       (void **)&dll.handle_reject,        1},
+    {"handle_process_batch",(void **)&dll.handle_process_batch, 1},
+    {"handle_open_v2",      (void **)&dll.handle_open_v2,       1},
+    {"handle_close_v2",     (void **)&dll.handle_close_v2,      1},
+    {"handle_input_v2",     (void **)&dll.handle_input_v2,      1},
+    {"handle_process_v2",   (void **)&dll.handle_process_v2,    1},
+    {"handle_thread_init",  (void **)&dll.handle_thread_init,   1},
+    {"handle_thread_fini",  (void **)&dll.handle_thread_fini,   1},
     {NULL, NULL, 0}
 };
 
@@ -173,6 +198,10 @@ static void vb_signal_handler(int signo) {
         case SIGCHLD:
             vb_reap = 1;
             break;
+
+        case SIGALRM:
+            vb_alarm = 1;
+            break;
         }
         break;
     case VB_PROCESS_WORKER:
@@ -262,6 +291,19 @@ static int init_signals() {
     return 0;
 }
 
+/* The workers in the slots before `slot', a respawned worker gets the
+ * same CPU. */
+static int worker_index(int slot) {
+    int i, n = 0;
+
+    for (i = 0; i < slot; ++i) {
+        if (vb_processes[i].proc == worker_process_cycle) {
+            ++n;
+        }
+    }
+    return n;
+}
+
 static pid_t spawn_process(child_proc_t proc, void *data, 
         const char *name, int respawn) {
     int s;
@@ -293,6 +335,12 @@ static pid_t spawn_process(child_proc_t proc, void *data,
         return -1;
     case 0: /* child process */
         daemon_set_title(name);
+        if (proc == worker_process_cycle) {
+            route_attach(worker_index(s));
+            affinity_apply_worker(worker_index(s));
+        } else {
+            affinity_apply_conn();
+        }
         proc(data);
         break;
     default:
@@ -353,6 +401,12 @@ static int reap_children() {
             continue;
         }
 
+        if (vb_processes[i].exited && vb_processes[i].exiting) {
+            /* Retired, the slot can be reused. */
+            vb_processes[i].pid = -1;
+            continue;
+        }
+
         if (vb_processes[i].exited) {
             if (vb_processes[i].respawn &&
                 !vb_processes[i].exiting &&
@@ -383,6 +437,109 @@ static void create_processes(child_proc_t func,
     }
 }
 
+/* The workers taking requests, and those retiring. */
+static int count_workers(int *retiring) {
+    int i, n = 0;
+
+    *retiring = 0;
+    for (i = 0; i < vb_last_process; ++i) {
+        if (vb_processes[i].pid == -1
+                || vb_processes[i].proc != worker_process_cycle
+                || vb_processes[i].exited) {
+            continue;
+        }
+        if (vb_processes[i].exiting) {
+            ++*retiring;
+        } else {
+            ++n;
+        }
+    }
+    return n;
+}
+
+/* The workers are indexed by slot, so the indexes taking requests run up
+ * to the highest one of a worker not retiring, those crashed included as
+ * they are respawned with the same index. */
+static int route_size(void) {
+    int i, n = 0;
+
+    for (i = 0; i < vb_last_process; ++i) {
+        if (vb_processes[i].pid != -1
+                && vb_processes[i].proc == worker_process_cycle
+                && !vb_processes[i].exiting) {
+            n = worker_index(i) + 1;
+        }
+    }
+    return n;
+}
+
+/* The worker exits after the request it's processing, it's not 
+ * respawned. With a routing policy, the conn process stops routing to
+ * it first, and it answers the requests queued to it before exiting.
+ * The worker with the highest index is retired, so that it falls out of
+ * the route, not before it's respawned if it crashed. */
+static void retire_worker(void) {
+    int i;
+
+    for (i = vb_last_process - 1; i >= 0; --i) {
+        if (vb_processes[i].pid != -1
+                && vb_processes[i].proc == worker_process_cycle
+                && !vb_processes[i].exiting) {
+            if (vb_processes[i].exited) {
+                return;
+            }
+            vb_processes[i].exiting = 1;
+            route_set_workers(route_size());
+            kill(vb_processes[i].pid, SIGTERM);
+            NOTICE_LOG("Retire worker[%d]", vb_processes[i].pid);
+            return;
+        }
+    }
+}
+
+/* Grow the pool when all the workers are busy and requests are still 
+ * queued, shrink it when at most half of the workers are busy and the
+ * queue is empty. Either has to hold for several ticks in a row. */
+static void scale_workers(void) {
+    static int up_ticks, down_ticks;
+    int retiring;
+    int n = count_workers(&retiring);
+    int busy = worker_busy();
+    int depth = route_queued();
+    pid_t pid;
+
+    /* The workers are indexed by slot, wait for the slot of the retiring
+     * one to be freed. */
+    if (retiring) {
+        return;
+    }
+
+    if (depth > 0 && busy >= n && n < worker_max) {
+        down_ticks = 0;
+        if (++up_ticks < SCALE_UP_TICKS) {
+            return;
+        }
+        up_ticks = 0;
+        pid = spawn_process(worker_process_cycle, (void *)&vb_cycle,
+                PROG_NAME":[worker]", VB_PROCESS_RESPAWN);
+        if (pid > 0) {
+            route_set_workers(route_size());
+            NOTICE_LOG("Spawn worker[%d], %d workers busy, %d queued",
+                    pid, busy, depth);
+        }
+    } else if (depth == 0 && busy * 2 <= n && n > worker_min) {
+        up_ticks = 0;
+        if (++down_ticks < SCALE_DOWN_TICKS) {
+            return;
+        }
+        down_ticks = 0;
+        retire_worker();
+    } else {
+        up_ticks = 0;
+        down_ticks = 0;
+    }
+}
+
 /*
 static void signal_worker_processes(int signo) {
     int i = 0;
@@ -400,6 +557,12 @@ static void signal_worker_processes(int signo) {
 
 static void master_process_cycle() {
     int live = 1;
+    void *addr;
+    size_t len;
+    int worker_num;
+    int thread_mode;
+    int interval;
+    struct itimerval itv;
     sigset_t set;
     sigemptyset(&set);
 
@@ -408,6 +571,7 @@ static void master_process_cycle() {
     sigaddset(&set, SIGCHLD);
     sigaddset(&set, SIGINT);
     sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGALRM);
 
     if (sigprocmask(SIG_BLOCK, &set, NULL) == -1) {
         FATAL_LOG("sigprocmask failed");
@@ -420,24 +584,72 @@ static void master_process_cycle() {
         exit(1);
     }
 
-    if (!(recv_queue = shmq_create(
-                conf_get_int_value(&g_conf, "shmq_recv", 1 << 20)))) {
+    /* The busy workers counter for scaling the pool. */
+    if (worker_stats_create() < 0) {
+        FATAL_LOG("Create worker stats failed");
+        exit(1);
+    }
+
+    /* In thread mode, the workers are spawned by the conn process. */
+    thread_mode = !strcmp(conf_get_str_value(&vb_cycle.conf, 
+                "worker_mode", "process"), "thread");
+    worker_num = conf_get_int_value(&vb_cycle.conf, "worker_num", 4);
+    worker_min = conf_get_int_value(&vb_cycle.conf, "worker_min",
+            worker_num);
+    worker_max = conf_get_int_value(&vb_cycle.conf, "worker_max",
+            worker_num);
+    if (worker_min < 1) worker_min = 1;
+    if (worker_max < worker_min) worker_max = worker_min;
+    if (worker_num < worker_min) worker_num = worker_min;
+    if (worker_num > worker_max) worker_num = worker_max;
+
+    /* The requests are routed to the worker processes by 'route'. */
+    if (!thread_mode 
+            && route_init(&vb_cycle.conf, worker_num, worker_max) != 0) {
+        FATAL_LOG("Initialize request routing failed");
+        exit(1);
+    }
+
+    if (route_policy() == ROUTE_SHARED && !(recv_queue = shmq_create(
+                conf_get_int_value(&vb_cycle.conf, "shmq_recv", 1 << 20)))) {
         FATAL_LOG("Create shared memory queue for receiving failed");
         exit(1);
     }
 
     if (!(send_queue = shmq_create(
-                conf_get_int_value(&g_conf, "shmq_send", 1 << 20)))) {
+                conf_get_int_value(&vb_cycle.conf, "shmq_send", 1 << 20)))) {
         FATAL_LOG("Create shared memory queue for sending failed");
         exit(1);
     }
 
-    create_processes(conn_process_cycle, (void *)&g_conf, 
+    /* Keep the queues on the node of the conn and worker processes. */
+    if (recv_queue) {
+        addr = shmq_memory(recv_queue, &len);
+        affinity_bind_memory(addr, len);
+    }
+    addr = shmq_memory(send_queue, &len);
+    affinity_bind_memory(addr, len);
+
+    create_processes(conn_process_cycle, (void *)&vb_cycle, 
             PROG_NAME":[conn]", 1, VB_PROCESS_RESPAWN);
-    create_processes(worker_process_cycle, (void *)&g_conf, 
-            PROG_NAME":[worker]",
-            conf_get_int_value(&g_conf, "worker_num", 4),
-            VB_PROCESS_RESPAWN);
+
+    if (!thread_mode) {
+        create_processes(worker_process_cycle, (void *)&vb_cycle, 
+                PROG_NAME":[worker]", worker_num, VB_PROCESS_RESPAWN);
+
+        /* Check the load every 'scale_interval' milliseconds. */
+        if (worker_max > worker_min) {
+            interval = conf_get_int_value(&vb_cycle.conf, 
+                    "scale_interval", 1000);
+            itv.it_interval.tv_sec = interval / 1000;
+            itv.it_interval.tv_usec = (interval % 1000) * 1000;
+            itv.it_value = itv.it_interval;
+            if (setitimer(ITIMER_REAL, &itv, NULL) == -1) {
+                FATAL_LOG("setitimer failed:%s", strerror(errno));
+                exit(1);
+            }
+        }
+    }
 
     /* Don't close any fds. Because the master will spawn process on 
      * the fly once the chile aborted. */
@@ -455,14 +667,24 @@ static void master_process_cycle() {
             live = reap_children();
         }
 
+        if (vb_alarm) {
+            vb_alarm = 0;
+            if (!vb_quit) {
+                scale_workers();
+            }
+        }
+
         if (!live && vb_quit) {
             if (dll.handle_fini) {
-                dll.handle_fini(&g_conf, vb_process);
+                dll.handle_fini(&vb_cycle, vb_process);
             }
 
             /* release relevant resources */
-            shmq_free(recv_queue);
+            if (recv_queue) {
+                shmq_free(recv_queue);
+            }
             shmq_free(send_queue);
+            route_free();
             unload_so(&handle);
             unlink(pid_file);
             exit(0);
@@ -553,7 +775,7 @@ int main(int argc, char *argv[]) {
     parse_options(argc, argv);
 
     if (!conf_file) conf_file = "./verben.conf";
-    if (conf_init(&g_conf, conf_file) != 0) {
+    if (conf_init(&vb_cycle.conf, conf_file) != 0) {
         BOOT_FAILED("Load conf file [%s]", conf_file);
     }
     init_vb_processes();
@@ -562,12 +784,13 @@ int main(int argc, char *argv[]) {
         BOOT_FAILED("Initialize signal handlers");
     }
 
-    if (log_init(conf_get_str_value(&g_conf, "log_dir", "/tmp"),
-            conf_get_str_value(&g_conf, "log_name", PROG_NAME".log"),
-            conf_get_int_value(&g_conf, "log_level", LOG_LEVEL_ALL),
-            conf_get_int_value(&g_conf, "log_size", LOG_FILE_SIZE),
-            conf_get_int_value(&g_conf, "log_num", LOG_FILE_NUM),
-            conf_get_int_value(&g_conf, "log_multi", LOG_MULTI_NO)) < 0) {
+    if (log_init(conf_get_str_value(&vb_cycle.conf, "log_dir", "/tmp"),
+            conf_get_str_value(&vb_cycle.conf, "log_name", PROG_NAME".log"),
+            conf_get_int_value(&vb_cycle.conf, "log_level", LOG_LEVEL_ALL),
+            conf_get_int_value(&vb_cycle.conf, "log_size", LOG_FILE_SIZE),
+            conf_get_int_value(&vb_cycle.conf, "log_num", LOG_FILE_NUM),
+            conf_get_int_value(&vb_cycle.conf, "log_multi", 
+                LOG_MULTI_NO)) < 0) {
         BOOT_FAILED("Initialize log file");
     }
 
@@ -577,12 +800,29 @@ int main(int argc, char *argv[]) {
     }
 
     /* load .so file */
-    so_name = conf_get_str_value(&g_conf, "so_file", NULL);
+    so_name = conf_get_str_value(&vb_cycle.conf, "so_file", NULL);
     if (load_so(&handle, syms, so_name) < 0) {
         BOOT_FAILED("load so file %s", so_name ? so_name : "(NULL)");
     }
 
-    pid_file = conf_get_str_value(&g_conf, "pid_file", PID_FILE);
+    if (framing_init(&vb_cycle.conf) != 0) {
+        BOOT_FAILED("Invalid framing %s", 
+                conf_get_str_value(&vb_cycle.conf, "framing", ""));
+    }
+
+    /* A hook of the version 2 API replaces the one of the version 1. 
+     * With 'framing', the messages are cut without handle_input. */
+    if (!dll.handle_input && !dll.handle_input_v2 
+            && framing_type() == FRAMING_NONE) {
+        BOOT_FAILED("%s has neither handle_input nor handle_input_v2",
+                so_name);
+    }
+    if (!dll.handle_process && !dll.handle_process_v2) {
+        BOOT_FAILED("%s has neither handle_process nor handle_process_v2",
+                so_name);
+    }
+
+    pid_file = conf_get_str_value(&vb_cycle.conf, "pid_file", PID_FILE);
     pid = pid_file_running(pid_file);
 
     if (daemon_action == DAEMON_START) {
@@ -616,9 +856,17 @@ int main(int argc, char *argv[]) {
         exit(0);
     }
 
+    if (affinity_init(&vb_cycle.conf) != 0) {
+        BOOT_FAILED("Initialize CPU affinity");
+    }
+
+    if (liveness_init(&vb_cycle.conf) != 0) {
+        BOOT_FAILED("Allocate the connection liveness table");
+    }
+
     /* Invoke the hook in master. */
     if (dll.handle_init) {
-        if (dll.handle_init(&g_conf, vb_process) != VERBEN_OK) {
+        if (dll.handle_init(&vb_cycle, vb_process) != VERBEN_OK) {
             BOOT_FAILED("Invoke hook handle_init in master");
         }
     }
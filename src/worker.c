@@ -6,6 +6,9 @@
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include "verben.h"
 #include "daemon.h"
 #include "worker.h"
@@ -15,17 +18,729 @@
 #include "conf.h"
 #include "log.h"
 #include "notifier.h"
+#include "coro.h"
+#include "mpmc.h"
+#include "affinity.h"
+#include "route.h"
+#include "group.h"
+#include "liveness.h"
+#include "codel.h"
 
-void worker_process_cycle(void *data) {
-    shm_msg *msg = NULL;
+#define MAX_REQUESTS_ROUND  128
+#define MAX_BATCH_SIZE      256
+#define MAX_FREE_REQS       64
+
+#define WORKER_MODE_PROCESS     0
+#define WORKER_MODE_COROUTINE   1
+#define WORKER_MODE_THREAD      2
+
+/* A request being processed by handle_process. */
+typedef struct request_ctx {
+    shm_msg         *msg;       /* NULL once handle_process returned */
+    int             len;
+    verben_req_t    *req;
+    int             replied;
+} request_ctx;
+
+static __thread request_ctx *current;   /* in process or thread mode */
+
+/* The tokens are reused along with their arenas. */
+static __thread verben_req_t *free_reqs[MAX_FREE_REQS];
+static __thread int nfree_reqs;
+static int pool_size = POOL_BLOCK_SIZE;
+static volatile int pending_requests;
+static int worker_mode;
+static int coro_max;
+static int coro_requests;       /* requests running on coroutines */
+static int coro_throttled;
+static int draining;            /* retired, answering the queued requests */
+static int batching;            /* with handle_process_batch */
+static int batch_size;
+static long long codel_target;  /* 0 if the requests aren't shed */
+static long long codel_interval;
+static __thread codel_t codel;
+static volatile int shed_requests;
+
+/* Thread mode, the workers are threads of the conn process. */
+static pthread_t *threads;
+static int nthreads;
+static mpmc_t *req_queue;
+static mpmc_t *resp_queue;
+static volatile int threads_quit;
+static volatile int threads_queued;     /* requests in `req_queue' */
+static volatile int resp_wake;
+static volatile int idle_threads;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static vb_cycle_t thread_cycle;
+
+/* Shared with the master, the number of worker processes in a round of 
+ * requests. */
+static volatile int *busy_workers;
+
+int worker_stats_create(void) {
+    busy_workers = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (busy_workers == MAP_FAILED) {
+        busy_workers = NULL;
+        return -1;
+    }
+    *busy_workers = 0;
+    return 0;
+}
+
+int worker_busy(void) {
+    return busy_workers ? *busy_workers : 0;
+}
+
+/* In thread mode, the response is passed to the conn thread by pointer.
+ * Only the first response after the conn thread found the queue empty
+ * writes the notifier. */
+static int thread_send_response(shm_msg *msg, int len) {
+    while (mpmc_push(resp_queue, msg, len) != 0) {
+        if (threads_quit) {
+            free(msg);
+            return -1;
+        }
+        sched_yield(); /* the conn thread is behind */
+    }
+
+    __sync_synchronize();
+    if (!resp_wake && !__sync_lock_test_and_set(&resp_wake, 1)) {
+        if (notifier_write() < 0) {
+            ERROR_LOG("notifier_write failed:%s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Put the message into the send queue and wake up the conn process. 
+ * `msg' is freed. */
+static int send_to_conn(shm_msg *msg, int len) {
+    int ret;
+
+    if (worker_mode == WORKER_MODE_THREAD) {
+        return thread_send_response(msg, len);
+    }
+
+    ret = shmq_push(send_queue, msg, len, SHMQ_WAIT | SHMQ_LOCK);
+    free(msg);
+
+    if (ret < 0) {
+        ERROR_LOG("shmq_push to send_queue in worker[%d] failed",
+                getpid());
+        return -1;
+    } else if (ret == 1) {
+        return -1;
+    }
+
+    if (notifier_write() < 0) {
+        ERROR_LOG("notifier_write failed:%s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Put the response into the send queue and wake up the conn process.
+ * The request message `msg' is reused to carry the response, unless it
+ * was written into `resp' by the plugin. Both are freed in this 
+ * function. */
+static int send_response(shm_msg *msg, int ret, const char *retdata, 
+        int retlen, shm_msg *resp) {
     shm_msg *temp_msg;
-    int     msg_len;
+
+    assert(retlen >= 0);
+    if (ret == VERBEN_ERROR) {
+        retlen = 0;
+    }
+
+    /* Worker processes don't modify the message header segment. */
+    if (resp && retlen > 0 && retdata == resp->data) {
+        free(msg);
+        temp_msg = resp;
+        retdata = NULL; /* in place already */
+    } else if (retlen > 0) {
+        temp_msg = (shm_msg*)realloc(msg, sizeof(shm_msg) + retlen);
+    } else {
+        temp_msg = msg;
+    }
+
+    if (!temp_msg) {
+        FATAL_LOG("Out of memory");
+        exit(1);
+    }
+
+    /* Whether close the connection after send the response. */
+    if (ret == VERBEN_CONN_CLOSE || ret == VERBEN_ERROR) {
+        temp_msg->close_conn = 1;
+    } else {
+        temp_msg->close_conn = 0;
+    }
+
+    if (retdata && retlen > 0) {
+        memcpy((char *)temp_msg + sizeof(shm_msg), retdata, retlen);
+    }
+    if (resp && resp != temp_msg) {
+        free(resp); /* allocated but not used */
+    }
+
+    ret = send_to_conn(temp_msg, sizeof(shm_msg) + retlen);
+    if (worker_mode != WORKER_MODE_THREAD) {
+        route_done();
+    }
+    return ret;
+}
+
+/* In coroutine mode, each coroutine carries its own request. */
+static request_ctx *current_ctx(void) {
+    coro_t *co = coro_current();
+    return co ? (request_ctx *)coro_arg(co) : current;
+}
+
+static verben_req_t *req_get(void) {
+    verben_req_t *req;
+
+    if (nfree_reqs > 0) {
+        return free_reqs[--nfree_reqs];
+    }
+
+    req = (verben_req_t *)malloc(sizeof(*req));
+    if (req) {
+        req->pool = NULL;
+    }
+    return req;
+}
+
+/* The arena keeps its first block for the next request. */
+static void req_put(verben_req_t *req) {
+    if (req->pool) {
+        pool_reset(req->pool);
+    }
+    if (nfree_reqs < MAX_FREE_REQS) {
+        free_reqs[nfree_reqs++] = req;
+        return;
+    }
+    if (req->pool) {
+        pool_free(req->pool);
+    }
+    free(req);
+}
+
+verben_req_t *verben_current(void) {
+    request_ctx *ctx = current_ctx();
+
+    if (!ctx || !ctx->msg) {
+        return NULL; /* Not in handle_process. */
+    }
+
+    if (!ctx->req) {
+        ctx->req = req_get();
+        if (!ctx->req) {
+            return NULL;
+        }
+        ctx->req->msg = ctx->msg;
+        ctx->req->len = ctx->len;
+        ctx->req->resp = NULL;
+    }
+    return ctx->req;
+}
+
+void *verben_palloc(verben_req_t *req, size_t size) {
+    if (!req) {
+        return NULL;
+    }
+    if (!req->pool && !(req->pool = pool_create(pool_size))) {
+        return NULL;
+    }
+    return pool_alloc(req->pool, size);
+}
+
+char *verben_pstrndup(verben_req_t *req, const char *s, size_t n) {
+    if (!req) {
+        return NULL;
+    }
+    if (!req->pool && !(req->pool = pool_create(pool_size))) {
+        return NULL;
+    }
+    return pool_strndup(req->pool, s, n);
+}
+
+char *verben_response_alloc(verben_req_t *req, int len) {
+    shm_msg *resp;
+
+    if (!req || len < 0) {
+        return NULL;
+    }
+
+    resp = (shm_msg *)realloc(req->resp, sizeof(shm_msg) + len);
+    if (!resp) {
+        return NULL;
+    }
+
+    /* The header routes the response back to the connection. */
+    memcpy(resp, req->msg, sizeof(shm_msg));
+    req->resp = resp;
+    return resp->data;
+}
+
+int verben_reply(verben_req_t *req, const char *buf, int len, int flags) {
+    request_ctx *ctx = current_ctx();
+    int ret;
+
+    if (!req) {
+        return -1;
+    }
+
+    ret = send_response(req->msg, flags, buf, len, req->resp);
+    if (ctx && req == ctx->req) {
+        /* Replied before handle_process returned. The message has been
+         * freed, verben_current() must not hand it out again. */
+        ctx->msg = NULL;
+        ctx->req = NULL;
+        ctx->replied = 1;
+    } else {
+        __sync_fetch_and_sub(&pending_requests, 1);
+    }
+    req_put(req);
+    return ret;
+}
+
+verben_conn_t verben_conn_id(verben_req_t *req) {
+    return req ? req->msg->conn_id : 0;
+}
+
+/* The group name, if any, goes ahead of the data. */
+static int push_message(int type, verben_conn_t conn, const char *group,
+        const char *buf, int len) {
+    int name_len = 0;
+    shm_msg *msg;
+
+    if (group) {
+        name_len = strlen(group);
+        if (name_len == 0 || name_len > GROUP_NAME_MAX) {
+            return -1;
+        }
+        name_len += (type == SHM_MSG_GROUP); /* with the NUL */
+    }
+    if (len < 0 || (len > 0 && !buf)) {
+        return -1;
+    }
+
+    msg = (shm_msg *)malloc(sizeof(shm_msg) + name_len + len);
+    if (!msg) {
+        return -1;
+    }
+    memset(msg, 0, sizeof(shm_msg));
+#ifdef DEBUG
+    msg->magic = CONN_MSG_MAGIC;
+#endif /* DEBUG */
+    msg->type = type;
+    msg->conn_id = conn;
+    memcpy(msg->data, group, name_len);
+    if (len > 0) {
+        memcpy(msg->data + name_len, buf, len);
+    }
+    return send_to_conn(msg, sizeof(shm_msg) + name_len + len);
+}
+
+int verben_cancelled(verben_req_t *req) {
+    return req && !liveness_check(req->msg->conn_id);
+}
+
+int verben_push(verben_conn_t conn, const char *buf, int len) {
+    return push_message(SHM_MSG_PUSH, conn, NULL, buf, len);
+}
+
+int verben_group_join(verben_conn_t conn, const char *group) {
+    return push_message(SHM_MSG_JOIN, conn, group, NULL, 0);
+}
+
+int verben_group_leave(verben_conn_t conn, const char *group) {
+    return push_message(SHM_MSG_LEAVE, conn, group, NULL, 0);
+}
+
+int verben_group_push(const char *group, const char *buf, int len) {
+    return push_message(SHM_MSG_GROUP, 0, group, buf, len);
+}
+
+int verben_broadcast(const char *buf, int len) {
+    return push_message(SHM_MSG_BROADCAST, 0, NULL, buf, len);
+}
+
+/* Invoke handle_process and answer the request, unless the plugin
+ * deferred the response. */
+static void run_request(request_ctx *ctx) {
     int     ret;
-    char    *retdata;
-    int     retlen;
+    char    *retdata = NULL;
+    int     retlen = 0;
+    shm_msg *msg = ctx->msg;
+    shm_msg *resp = NULL;
+    verben_req_t *req = NULL;
+    int     in_place;
+
+    if (dll.handle_process_v2) {
+        ret = dll.handle_process_v2(msg->ctx, msg->data,
+                ctx->len - sizeof(shm_msg),
+                &retdata, &retlen, msg->remote_ip, msg->remote_port);
+    } else {
+        ret = dll.handle_process((char*)msg + sizeof(shm_msg),
+                ctx->len - sizeof(shm_msg),
+                &retdata, &retlen, msg->remote_ip, msg->remote_port);
+    }
+
+    ctx->msg = NULL;
+    if (ret == VERBEN_PENDING) {
+        /* The plugin will reply later through verben_reply(), the
+         * message header is retained until then. */
+        if (ctx->req) {
+            __sync_fetch_and_add(&pending_requests, 1);
+        } else if (!ctx->replied) {
+            ERROR_LOG("handle_process returned VERBEN_PENDING "
+                    "without a request token");
+            send_response(msg, VERBEN_ERROR, NULL, 0, NULL);
+        }
+        ctx->req = NULL;
+        return;
+    }
+
+    if (ctx->req) {
+        /* Answered synchronously, the token is no longer valid. Its
+         * arena is released after handle_process_post. */
+        req = ctx->req;
+        resp = req->resp;
+        ctx->req = NULL;
+    }
+    in_place = resp && retdata == resp->data;
+
+    /* Already answered by verben_reply(), which freed the message. */
+    if (!ctx->replied) {
+        send_response(msg, ret, retdata, retlen, resp);
+    }
+
+    if (dll.handle_process_post && !in_place) {
+        dll.handle_process_post(retdata, retlen);
+    }
+
+    if (req) {
+        req_put(req);
+    }
+}
+
+/* The connection closed while the request was queued, nobody waits for
+ * the response. The message is freed if so. */
+static int cancelled(shm_msg *msg) {
+    if (liveness_check(msg->conn_id)) {
+        return 0;
+    }
+
+    DEBUG_LOG("Request of closed connection %s:%d skipped",
+            msg->remote_ip, msg->remote_port);
+    free(msg);
+    if (worker_mode != WORKER_MODE_THREAD) {
+        route_done();
+    }
+    return 1;
+}
+
+static long long ustime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Shed the request if the queue has stood above the target delay, it's
+ * answered by handle_reject. The message is freed if so. */
+static int shed(shm_msg *msg, int len) {
+    char    *retdata = NULL;
+    int     retlen = 0;
+    int     ret = VERBEN_ERROR;
+    long long now;
+
+    if (!codel_target) {
+        return 0;
+    }
+    now = ustime();
+    if (!codel_should_drop(&codel, now - msg->enqueue_us, now)) {
+        return 0;
+    }
+
+    __sync_fetch_and_add(&shed_requests, 1);
+    if (dll.handle_reject) {
+        ret = dll.handle_reject(msg->data, len - sizeof(shm_msg), 
+                &retdata, &retlen, msg->remote_ip, msg->remote_port);
+        if (ret == VERBEN_PENDING) {
+            ret = VERBEN_ERROR;
+        }
+    }
+    send_response(msg, ret, retdata, retlen, NULL);
+    if (dll.handle_process_post) {
+        dll.handle_process_post(retdata, retlen);
+    }
+    return 1;
+}
+
+/* When the worker is full, the queue is left to the other workers, and
+ * checked again once a coroutine finishes. */
+static void request_coro(void *arg) {
+    run_request((request_ctx *)arg);
+    free(arg);
+
+    if (--coro_requests < coro_max && coro_throttled) {
+        coro_throttled = 0;
+        if (route_wake_self() < 0) {
+            ERROR_LOG("route_wake_self failed:%s", strerror(errno));
+        }
+    }
+}
+
+/* Process a request popped from the recv queue, `msg' is freed or
+ * retained for the deferred response. In coroutine mode, the request
+ * runs on a coroutine which yields to the event loop on I/O. */
+static void process_request(shm_msg *msg, int msg_len) {
+    request_ctx ctx;
+    request_ctx *co_ctx;
+    coro_t *co;
+
+    if (cancelled(msg) || shed(msg, msg_len)) {
+        return;
+    }
+
+    if (worker_mode != WORKER_MODE_COROUTINE) {
+        ctx.msg = msg;
+        ctx.len = msg_len;
+        ctx.req = NULL;
+        ctx.replied = 0;
+        current = &ctx;
+        run_request(&ctx);
+        current = NULL;
+        return;
+    }
+
+    co_ctx = (request_ctx *)malloc(sizeof(*co_ctx));
+    co = co_ctx ? coro_create(request_coro, co_ctx) : NULL;
+    if (!co) {
+        ERROR_LOG("Create coroutine in worker[%d] failed", getpid());
+        free(co_ctx);
+        send_response(msg, VERBEN_ERROR, NULL, 0, NULL);
+        return;
+    }
+    co_ctx->msg = msg;
+    co_ctx->len = msg_len;
+    co_ctx->req = NULL;
+    co_ctx->replied = 0;
+
+    ++coro_requests;
+    coro_resume(co);
+}
+
+/* Hand a batch of requests to handle_process_batch and answer them,
+ * the messages are freed. */
+static void process_batch(shm_msg **msgs, int *lens, int n) {
+    verben_msg_t    in[MAX_BATCH_SIZE];
+    verben_resp_t   out[MAX_BATCH_SIZE];
+    int             i, m, ret;
+
+    for (i = 0, m = 0; i < n; ++i) {
+        if (!cancelled(msgs[i]) && !shed(msgs[i], lens[i])) {
+            msgs[m] = msgs[i];
+            lens[m++] = lens[i];
+        }
+    }
+    if ((n = m) == 0) {
+        return;
+    }
+
+    for (i = 0; i < n; ++i) {
+        in[i].data = msgs[i]->data;
+        in[i].len = lens[i] - sizeof(shm_msg);
+        in[i].remote_ip = msgs[i]->remote_ip;
+        in[i].remote_port = msgs[i]->remote_port;
+        in[i].ctx = msgs[i]->ctx;
+        out[i].ret = VERBEN_ERROR;
+        out[i].data = NULL;
+        out[i].len = 0;
+    }
+
+    ret = dll.handle_process_batch(in, n, out);
+
+    for (i = 0; i < n; ++i) {
+        if (ret != VERBEN_OK) {
+            out[i].ret = VERBEN_ERROR;
+        } else if (out[i].ret == VERBEN_PENDING) {
+            ERROR_LOG("VERBEN_PENDING isn't supported in a batch");
+            out[i].ret = VERBEN_ERROR;
+        }
+        send_response(msgs[i], out[i].ret, out[i].data, out[i].len, NULL);
+
+        if (dll.handle_process_post) {
+            dll.handle_process_post(out[i].data, out[i].len);
+        }
+    }
+}
+
+/* A retired worker exits once the requests routed to it are answered. */
+static void check_drained(void) {
+    if (!coro_requests && !pending_requests && route_queued_self() == 0) {
+        vb_worker_quit = 1;
+    }
+}
+
+/* Woken up by the conn process, drain the recv queue. The requests 
+ * processed in a round are limited to let the timers and the other 
+ * events registered by the plugin run, the workers are woken up again
+ * for the rest. */
+static void request_handler(ae_event_loop *el, int fd, 
+        void *privdata, int mask) {
+    static shm_msg *msgs[MAX_BATCH_SIZE];
+    static int lens[MAX_BATCH_SIZE];
+    int     got;
+    int     n;
+    AE_NOTUSED(el);
+    AE_NOTUSED(fd);
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(mask);
+
+    while (route_read() > 0) {
+        /* Drain the pipe before popping, so no wakeup is lost. */
+    }
+
+    for (n = 0; n < MAX_REQUESTS_ROUND; n += got) {
+        if (vb_worker_quit) {
+            break;
+        }
+
+        if (worker_mode == WORKER_MODE_COROUTINE 
+                && coro_requests >= coro_max) {
+            coro_throttled = 1;
+            break;
+        }
+
+        if (batching) {
+            got = route_pop_batch(msgs, lens, 
+                    MAX_REQUESTS_ROUND - n < batch_size 
+                    ? MAX_REQUESTS_ROUND - n : batch_size);
+        } else {
+            got = route_pop(&msgs[0], &lens[0]) == 0;
+        }
+        if (got <= 0) {
+            /* The queue is empty or stopped, or the lock failed. */
+            if (route_sleep() && route_wake_self() < 0) {
+                ERROR_LOG("route_wake_self failed:%s", strerror(errno));
+            }
+            break;
+        }
+
+        if (n == 0) {
+            __sync_fetch_and_add(busy_workers, 1);
+        }
+        if (batching) {
+            process_batch(msgs, lens, got);
+        } else {
+            process_request(msgs[0], lens[0]);
+        }
+    }
+
+    if (n > 0) {
+        __sync_fetch_and_sub(busy_workers, 1);
+    }
+
+    if (n == MAX_REQUESTS_ROUND && route_wake_self() < 0) {
+        ERROR_LOG("route_wake_self failed:%s", strerror(errno));
+    }
+
+    if (draining && n < MAX_REQUESTS_ROUND) {
+        check_drained();
+    }
+}
+
+/* A signal caught right before the loop falls asleep isn't seen until
+ * the next event, the cron bounds the time to exit. */
+static void log_shed(void) {
+    int n = shed_requests;
+
+    if (n > 0) {
+        __sync_fetch_and_sub(&shed_requests, n);
+        WARNING_LOG("Shed %d requests queued over %lldus", n, codel_target);
+    }
+}
+
+static int worker_cron(ae_event_loop *el, long long id, void *privdata) {
+    AE_NOTUSED(el);
+    AE_NOTUSED(id);
+    AE_NOTUSED(privdata);
+    if (draining) {
+        check_drained();
+    }
+    log_shed();
+    return 1000;
+}
+
+/* Up to 'batch_size' requests are passed to handle_process_batch. The
+ * coroutines run a request each, they don't batch. */
+static void set_batching(conf_t *conf) {
+    batching = dll.handle_process_batch 
+        && worker_mode != WORKER_MODE_COROUTINE;
+    batch_size = conf_get_int_value(conf, "batch_size", 32);
+    if (batch_size < 1) {
+        batch_size = 1;
+    } else if (batch_size > MAX_BATCH_SIZE) {
+        batch_size = MAX_BATCH_SIZE;
+    }
+}
+
+/* Shed the requests under overload with CoDel, see codel.h. */
+static void set_admission(conf_t *conf) {
+    codel_target = conf_get_int_value(conf, "codel_target", 0);
+    codel_interval = conf_get_int_value(conf, "codel_interval", 100000);
+    codel_init(&codel, codel_target, codel_interval);
+}
+
+void worker_process_cycle(void *data) {
+    vb_cycle_t      *cycle = (vb_cycle_t*)data;
+    ae_event_loop   *el;
+    char            *mode;
 
     vb_process = VB_PROCESS_WORKER;
-    
+
+    el = ae_create_event_loop_api(conf_get_str_value(&cycle->conf, 
+                "event_api", NULL));
+    if (!el) {
+        boot_notify(-1, "Initialize event loop in worker[%d]", getpid());
+        kill(getppid(), SIGQUIT);
+        exit(0);
+    }
+
+    if (ae_create_time_event(el, 1000, worker_cron, NULL, NULL) == AE_ERR
+            || ae_create_file_event(el, route_read_fd(), 
+                AE_READABLE, request_handler, NULL) == AE_ERR) {
+        boot_notify(-1, "Create events in worker[%d]", getpid());
+        kill(getppid(), SIGQUIT);
+        exit(0);
+    }
+
+    /* In coroutine mode, up to 'coro_max' requests run at once, each on
+     * a stack of 'coro_stack_size' bytes. */
+    mode = conf_get_str_value(&cycle->conf, "worker_mode", "process");
+    if (!strcmp(mode, "coroutine")) {
+        worker_mode = WORKER_MODE_COROUTINE;
+        coro_max = conf_get_int_value(&cycle->conf, "coro_max", 1024);
+        coro_init(el, conf_get_int_value(&cycle->conf, "coro_stack_size",
+                    CORO_STACK_SIZE), coro_max);
+    } else if (strcmp(mode, "process")) {
+        boot_notify(-1, "Unknown worker_mode %s in worker[%d]",
+                mode, getpid());
+        kill(getppid(), SIGQUIT);
+        exit(0);
+    }
+    set_batching(&cycle->conf);
+    set_admission(&cycle->conf);
+    pool_size = conf_get_int_value(&cycle->conf, "request_pool_size",
+            POOL_BLOCK_SIZE);
+
+    /* The plugin may register its own events on the loop. */
+    cycle->el = el;
     if (dll.handle_init) {
         if (dll.handle_init(data, vb_process) != VERBEN_OK) {
             boot_notify(-1, "Invoke hook handle_init in worker[%d]",
@@ -36,81 +751,193 @@ void worker_process_cycle(void *data) {
     }
 
     redirect_std();
+    ae_main(el, &vb_worker_quit);
 
-    for ( ; ; ) {
-        if (vb_worker_quit) {
-            if (dll.handle_fini) {
-                dll.handle_fini(data, vb_process);
+    if (route_retired()) {
+        /* Retired by the master, the conn process has stopped routing
+         * requests to us, answer those already queued. */
+        draining = 1;
+        vb_worker_quit = 0;
+        route_wake_self();
+        ae_main(el, &vb_worker_quit);
+    }
+
+    route_detach();
+    if (pending_requests || coro_requests) {
+        WARNING_LOG("worker[%d] exits with %d pending requests",
+                getpid(), pending_requests + coro_requests);
+    }
+    if (dll.handle_fini) {
+        dll.handle_fini(data, vb_process);
+    }
+    ae_free_event_loop(el);
+    exit(0);
+}
+
+static void *worker_thread(void *arg) {
+    int     index = (int)(long)arg;
+    shm_msg *msg;
+    int     msg_len;
+    int     got;
+    shm_msg *msgs[MAX_BATCH_SIZE];
+    int     lens[MAX_BATCH_SIZE];
+    int     n;
+
+    affinity_apply_worker(index);
+    codel_init(&codel, codel_target, codel_interval);
+    if (dll.handle_thread_init) {
+        if (dll.handle_thread_init(&thread_cycle, index) != VERBEN_OK) {
+            FATAL_LOG("Invoke hook handle_thread_init in thread[%d]",
+                    index);
+            kill(getppid(), SIGQUIT);
+            return NULL;
+        }
+    }
+
+    while (!threads_quit) {
+        got = mpmc_pop(req_queue, (void **)&msg, &msg_len) == 0;
+        if (!got) {
+            /* Announce the idleness before checking the queue again,
+             * pairs with the barrier in worker_threads_wake(). */
+            pthread_mutex_lock(&idle_lock);
+            ++idle_threads;
+            __sync_synchronize();
+            while (!threads_quit && !(got = 
+                        mpmc_pop(req_queue, (void **)&msg, &msg_len) == 0)) {
+                pthread_cond_wait(&idle_cond, &idle_lock);
             }
-            exit(0);
+            --idle_threads;
+            pthread_mutex_unlock(&idle_lock);
         }
 
-        ret = shmq_pop(recv_queue, (void **)&msg, &msg_len, 
-                    SHMQ_WAIT|SHMQ_LOCK);
-        if (ret < 0) {
-            if (errno != EINTR) {
-                ERROR_LOG("shmq_pop from recv_queue in worker[%d] failed:%s",
-                        getpid(), strerror(errno));
+        if (got && batching) {
+            /* Take the requests queued behind it. */
+            msgs[0] = msg;
+            lens[0] = msg_len;
+            for (n = 1; n < batch_size && mpmc_pop(req_queue, 
+                        (void **)&msgs[n], &lens[n]) == 0; ++n) {
+                /* void */
             }
-            if (msg) free(msg);
-            continue;
-        } else if (ret == 1) {
-            if (msg) free(msg);
-            continue;
+            __sync_fetch_and_sub(&threads_queued, n);
+            process_batch(msgs, lens, n);
+        } else if (got) {
+            __sync_fetch_and_sub(&threads_queued, 1);
+            process_request(msg, msg_len);
         }
+    }
+
+    if (dll.handle_thread_fini) {
+        dll.handle_thread_fini(&thread_cycle, index);
+    }
+    return NULL;
+}
 
-        retdata = NULL;
+int worker_threads_start(void *data) {
+    vb_cycle_t  *cycle = (vb_cycle_t*)data;
+    int         size;
+    sigset_t    set, old;
+    long        i;
 
-        ret = dll.handle_process((char*)msg + sizeof(shm_msg),
-                msg_len - sizeof(shm_msg),
-                &retdata, &retlen, msg->remote_ip, msg->remote_port);
+    worker_mode = WORKER_MODE_THREAD;
+    set_batching(&cycle->conf);
+    set_admission(&cycle->conf);
+    pool_size = conf_get_int_value(&cycle->conf, "request_pool_size",
+            POOL_BLOCK_SIZE);
+    nthreads = conf_get_int_value(&cycle->conf, "worker_num", 4);
+    size = conf_get_int_value(&cycle->conf, "thread_queue_size", 65536);
 
-        assert(retlen >= 0);
-        /* Worker processes don't modify the message header segment. */
-        if (retlen > 0) {
-            temp_msg = (shm_msg*)realloc(msg, sizeof(shm_msg) + retlen);
-        } else {
-            temp_msg = msg;
-        }
+    req_queue = mpmc_create(size);
+    resp_queue = mpmc_create(size);
+    threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    if (!req_queue || !resp_queue || !threads) {
+        return -1;
+    }
 
-        if (!temp_msg) {
-            FATAL_LOG("Out of memory");
-            exit(1);
-        }
+    /* The threads have no event loop of their own. */
+    thread_cycle.conf = cycle->conf;
+    thread_cycle.el = NULL;
 
-        /* Whether close the connection after send the response. */
-        if (ret == VERBEN_CONN_CLOSE || ret == VERBEN_ERROR) {
-            temp_msg->close_conn = 1;
-        } else {
-            temp_msg->close_conn = 0;
+    /* Signals are left to the conn thread. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, worker_thread, 
+                    (void *)i) != 0) {
+            nthreads = i;
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
 
-        if (ret != VERBEN_ERROR) {
-            if (retdata && retlen > 0) {
-                memcpy((char *)temp_msg + sizeof(shm_msg), retdata, retlen);
-            }
-        }
+void worker_threads_stop(void) {
+    shm_msg *msg;
+    int     len;
+    int     i;
 
-        if (dll.handle_process_post) {
-            dll.handle_process_post(retdata, retlen);
-        }
+    threads_quit = 1;
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
 
-        ret = shmq_push(send_queue, temp_msg, sizeof(shm_msg) + retlen, 
-                    SHMQ_WAIT | SHMQ_LOCK);
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
 
-        free(temp_msg);
+    if (pending_requests) {
+        WARNING_LOG("worker threads exit with %d pending requests",
+                pending_requests);
+    }
 
-        if (ret < 0) {
-            ERROR_LOG("shmq_push to send_queue in worker[%d] failed",
-                    getpid());
-            continue;
-        } else if (ret == 1) {
-            continue;
-        }
+    while (req_queue && mpmc_pop(req_queue, (void **)&msg, &len) == 0) {
+        free(msg);
+    }
+    while (resp_queue && mpmc_pop(resp_queue, (void **)&msg, &len) == 0) {
+        free(msg);
+    }
+    free(threads);
+}
 
-        if (notifier_write() < 0) {
-            ERROR_LOG("notifier_write failed:%s", strerror(errno));
-            continue;
+int worker_threads_queued(void) {
+    return threads_queued;
+}
+
+int worker_threads_push(shm_msg *msg, int len) {
+    if (mpmc_push(req_queue, msg, len) != 0) {
+        return -1;
+    }
+    __sync_fetch_and_add(&threads_queued, 1);
+    return 0;
+}
+
+/* Wake up to `n' idle threads for the requests pushed. */
+void worker_threads_wake(int n) {
+    __sync_synchronize();
+    if (!idle_threads) {
+        return; /* the busy threads will find them */
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    if (n >= idle_threads) {
+        pthread_cond_broadcast(&idle_cond);
+    } else {
+        while (n-- > 0) {
+            pthread_cond_signal(&idle_cond);
         }
     }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+int worker_threads_pop(shm_msg **msg, int *len) {
+    if (mpmc_pop(resp_queue, (void **)msg, len) == 0) {
+        return 0;
+    }
+
+    /* Empty, let the next response wake us up. A response pushed before
+     * the flag is cleared doesn't, so check once more. */
+    __sync_lock_release(&resp_wake);
+    __sync_synchronize();
+    return mpmc_pop(resp_queue, (void **)msg, len);
 }